@@ -1,100 +1,22 @@
-#include <string>
-using std::string;
-#include <unordered_map>
-using std::unordered_map;
-#include <iostream>
+#include "ll_runtime.h"
 #include <fstream>
+#include <sstream>
 #include <streambuf>
+#include <condition_variable>
+#include <future>
+#include <random>
+#include <functional>
+#include <filesystem>
 
-#define assert(E) if (!(E)) { std::cerr << "assert at " << __LINE__ << std::endl; rexit(-1);}
-
-void rexit(int i) {
-  exit(i);
-}
-
-bool trace_gc = false;
 bool trace_eval = false;
+bool trace_switches = false;
+thread_local size_t eval_steps = 0; // steps of the continuation passing evaluators
 bool cont_passing_mode = true;
+bool bytecode_mode = false; // classic syntax run by vm_run
+bool threaded_mode = false; // continuation passing syntax run by threaded_run
+bool transpile_mode = false; // print C++ instead of running
 
 // -- allocator
-const size_t kSlotsCount = 8192;
-const size_t tVal = kSlotsCount;
-const size_t tNum = tVal;
-const size_t tSymbol = tVal + 1;
-const size_t tFree = tVal + 2;
-
-struct Var{
-  size_t h;
-  union {
-    size_t t; // if h < tVal
-    int v;    // if h == tNum
-    string* s_name; // if h == tSymbol
-  };
-};
-
-Var vars [kSlotsCount];
-size_t max_var = 0;
-size_t allocated_count, first_free;
-unordered_map<string, size_t> symbols;
-
-void reset_allocator() {
-  symbols.clear();
-  symbols["nil"] = 0;
-  for (size_t i = 1; i <= max_var; i++)
-    if (vars[i].h == tSymbol)
-      delete vars[i].s_name;
-  max_var = allocated_count = first_free = 0;
-}
-
-size_t alloc_var() {
-  allocated_count++;
-  if (first_free)
-  {
-    size_t r = first_free;
-    first_free = vars[first_free].t;
-    return r;
-  }
-  assert(max_var < kSlotsCount - 1);
-  return ++max_var;
-}
-
-void free_var(size_t v) {
-    allocated_count--;
-    if (vars[v].h == tSymbol)
-        delete vars[v].s_name;
-    vars[v].h = tFree;
-    vars[v].t = first_free;
-    first_free = v;
-}
-
-int get_int(size_t v) { return vars[v].h == tNum ? vars[v].v : 0; }
-size_t h(size_t v) { return vars[v].h < tVal ? vars[v].h : 0; }
-size_t t(size_t v) { return vars[v].h < tVal ? vars[v].t : 0; }
-
-size_t mk_int(int v)
-{
-  size_t r = alloc_var();
-  vars[r].h = tNum;
-  vars[r].v = v;
-  return r;
-}
-
-size_t get_symbol(const string& name) {
-  auto a = symbols.find(name);
-  if (a != symbols.end())
-    return a->second;
-  size_t r = alloc_var();
-  vars[r].h = tSymbol;
-  vars[r].s_name = new string(name);
-  return symbols[name] = r;
-}
-size_t mk_pair(size_t h, size_t t) {
-  size_t r = alloc_var();
-  vars[r].h = h;
-  vars[r].t = t;
-  return r;
-}
-
 void allocator_test() {
   reset_allocator();
   size_t pair, a1, i2;
@@ -103,47 +25,30 @@ void allocator_test() {
     pair = mk_pair(
       get_symbol("test"),
       i2 = mk_int(42)));
-  assert(allocated_count == 4);
+  assert(allocated_count == 3);
   assert(get_int(i2) == 42);
+  assert(get_int(mk_int(-5)) == -5);
+  assert(get_int(mk_int(1 << 30)) == 1 << 30 && allocated_count == 4);
+  assert(get_int(mk_int(-(1 << 30))) == -(1 << 30) && allocated_count == 5);
+  assert(string(symbol_name(a1)) == "test");
   assert(h(pair) == a1);
   assert(h(root) == a1);
   assert(t(root) == pair);
   free_var(root);
-  assert(allocated_count == 3);
+  assert(allocated_count == 4);
   assert(mk_pair(0, 0) == root);
+  assert(!is_young(root));
+  size_t last = root;
+  for (size_t i = 0; i < kSegmentSize * 2; i++)
+    last = mk_pair(mk_int(int(i)), last);
+  assert(vars.capacity() > kSegmentSize * 2);
+  assert(get_int(h(last)) == int(kSegmentSize * 2 - 1));
+  assert(h(root) == 0 && t(root) == 0);
   reset_allocator();
 }
 
 // -- GC
 
-const auto kMark = ~(~size_t(0) >> 1);
-
-void gc_mark(size_t i) {
-  while (i) {
-    size_t h = vars[i].h;
-    vars[i].h |= kMark;
-    if (h & kMark || h >= tVal)
-      return;
-    gc_mark(h);
-    i = vars[i].t;
-  }
-}
-
-void gc_sweep() {
-  int freed_cnt = 0;
-  for (size_t i = 1; i <= max_var; i++) {
-    if (vars[i].h & kMark)
-      vars[i].h &= ~kMark;
-    else if (vars[i].h != tFree) {
-      free_var(i);
-      if (trace_gc)
-        freed_cnt++;
-    }
-  }
-  if (trace_gc)
-    std::cout << "gc: freed " << freed_cnt << std::endl;
-}
-
 void gc_test() {
   reset_allocator();
   size_t root = mk_pair(
@@ -153,63 +58,211 @@ void gc_test() {
       mk_int(42)));
   gc_mark(root);
   gc_sweep();
-  assert(allocated_count == 4);
+  assert(allocated_count == 3);
   vars[root].t = 0;
   gc_mark(root);
   gc_sweep();
   assert(allocated_count == 2);
   gc_sweep();
-  assert(allocated_count == 0);
+  assert(allocated_count == 1);
+  root = 0;
+  for (int i = 0; i < 100; i++)
+    root = mk_pair(mk_pair(mk_int(i), mk_pair(0, 0)), root);
+  mark_stack_limit = 4;
+  gc_mark(root);
+  mark_stack_limit = size_t(1) << 20;
+  gc_sweep();
+  assert(allocated_count == 301);
+  reset_allocator();
+  root = mk_pair(0, 0);
+  for (int i = 0; i < 200; i++)
+    mk_pair(0, 0);
+  gc_mark(root);
+  gc_start_sweep();
+  size_t fresh = mk_pair(mk_int(7), root);
+  assert(sweep_pos > 0 && sweep_pos < sweep_end);
+  gc_finish_sweep();
+  assert(allocated_count == 2 && get_int(h(fresh)) == 7);
   reset_allocator();
 }
 
-// -- visualization
+void generational_gc_test() {
+  reset_allocator();
+  size_t old = mk_pair(0, 0);
+  nursery_enabled = true;
+  Root root(mk_pair(mk_int(1), mk_pair(mk_int(2), 0)));
+  size_t young = mk_pair(mk_int(3), 0);
+  mk_pair(0, 0); // garbage
+  assert(is_young(root) && is_young(young));
+  set_t(old, young);
+  gc_minor();
+  assert(!is_young(root) && !is_young(t(old)));
+  assert(young_top == kYoungBase && allocated_count == 4);
+  assert(get_int(h(t(root))) == 2 && get_int(h(t(old))) == 3);
+  reset_allocator();
+}
+
+template<typename F>
+double time_ms(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void gc_benchmark() {
+  const int kDepth = 1 << 22;
+  reset_allocator();
+  size_t root = 0;
+  for (int i = 0; i < kDepth; i++)
+    root = mk_pair(root, mk_int(i));
+  std::cout << "gc deep tree " << kDepth << ": " << time_ms([&]{ gc_mark(root); gc_sweep(); }) << "ms" << std::endl;
+  reset_allocator();
+  root = 0;
+  for (int i = 0; i < kDepth; i++)
+    root = mk_pair(mk_int(i), root);
+  std::cout << "gc long list " << kDepth << ": " << time_ms([&]{ gc_mark(root); gc_sweep(); }) << "ms" << std::endl;
+  reset_allocator();
+}
 
-const size_t kDoubleMark = kMark >> 1;
+// -- parallel GC
 
-void format_mark_refs(size_t i) {
-  while (i) {
-    size_t h = vars[i].h;
-    if (h & kMark)
-      vars[i].h |= kDoubleMark;
-    if (h >= tVal)
-      break;
-    vars[i].h |= kMark;
-    format_mark_refs(h);
-    i = vars[i].t;
+void incremental_gc_test() {
+  reset_allocator();
+  size_t root = 0;
+  for (int i = 0; i < 10000; i++)
+    root = mk_pair(mk_pair(mk_int(i), 0), root);
+  size_t hidden = mk_pair(mk_int(-1), 0);
+  size_t holder = mk_pair(0, hidden);
+  Root r(mk_pair(holder, root));
+  gc_pause_budget_us = 1;
+  gc_collect(shadow_stack);
+  set_t(holder, 0); // hidden is now referenced only by the C++ local
+  size_t steps = 0;
+  for (; gc_marking; steps++)
+    gc_mark_step();
+  gc_pause_budget_us = 0;
+  gc_finish_sweep();
+  assert(steps > 1);
+  assert(vars[hidden].h != tFree && get_int(h(hidden)) == -1);
+  assert(allocated_count == 20003);
+  reset_allocator();
+}
+
+void parallel_gc_test() {
+  reset_allocator();
+  size_t root = 0;
+  for (int i = 0; i < 1000; i++)
+    root = mk_pair(mk_pair(mk_int(i), mk_pair(root, 0)), root);
+  for (int i = 0; i < 1000; i++)
+    mk_pair(0, 0);
+  Root r(root);
+  gc_threads = 4;
+  gc_collect(shadow_stack);
+  gc_threads = 1;
+  assert(allocated_count == 3000);
+  assert(get_int(h(h(root))) == 999 && get_int(h(h(t(root)))) == 998);
+  reset_allocator();
+}
+
+size_t mk_tree(int depth) {
+  return depth ? mk_pair(mk_tree(depth - 1), mk_tree(depth - 1)) : mk_int(depth);
+}
+
+void parallel_gc_benchmark() {
+  const int kDepth = 21;
+  reset_allocator();
+  Root root(mk_tree(kDepth));
+  size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+  for (gc_threads = 1; gc_threads <= max_threads; gc_threads *= 2) {
+    for (int i = 0; i < 1 << kDepth; i++)
+      mk_pair(0, 0);
+    std::cout << "gc tree " << (1 << kDepth) << " pairs, " << gc_threads << " threads: " <<
+      time_ms([&]{ gc_mark_parallel(shadow_stack); gc_sweep_parallel(); }) << "ms" << std::endl;
   }
+  gc_threads = 1;
+  reset_allocator();
 }
 
-string name_of(size_t i) {
-  string r;
-  do
-    r += 'a' + i % ('z' - 'a');
-  while ((i /= 'z' - 'a') != 0);
+// -- compaction
+
+int list_sum(size_t l) {
+  int r = 0;
+  for (; l; l = t(l))
+    r += get_int(h(l));
   return r;
 }
 
-string format_rec(size_t i) {
-  if (!i) return ".";
-  if (vars[i].h == tNum) return std::to_string(vars[i].v);
-  if (vars[i].h == tSymbol) return *vars[i].s_name;
-  if (!(vars[i].h & kMark)) return "#" + name_of(i);
-  string r;
-  if (vars[i].h & kDoubleMark) r += name_of(i) + ":";
-  r += '(';
-  do {
-    vars[i].h &= ~(kMark | kDoubleMark);
-    r += format_rec(vars[i].h);
-    r += ' ';
-    i = vars[i].t;
-  } while (i && !(vars[i].h & kDoubleMark) && (vars[i].h & kMark));
-  return r + format_rec(i) + ')';
+void compaction_test() {
+  reset_allocator();
+  size_t sym = get_symbol("test");
+  size_t list = 0;
+  for (int i = 0; i < 100; i++) {
+    list = mk_pair(mk_int(i), list);
+    mk_pair(0, 0);
+  }
+  Root root(mk_pair(sym, mk_pair(list, 0)));
+  gc_compact();
+  assert(allocated_count == 103);
+  assert(h(root) == sym && get_symbol("test") == sym);
+  list = h(t(root));
+  assert(list_sum(list) == 4950);
+  for (size_t i = list; t(i); i = t(i))
+    assert(t(i) == i + 1);
+  reset_allocator();
+}
+
+void vector_test() {
+  reset_allocator();
+  nursery_enabled = true;
+  Root v(mk_vector(3));
+  assert(is_young(v) && vector_size(v) == 3 && get_slot(v, 2) == 0);
+  set_slot(v, 0, mk_pair(mk_int(1), 0));
+  set_slot(v, 2, mk_vector(1));
+  set_slot(get_slot(v, 2), 0, mk_int(2));
+  mk_vector(5); // garbage
+  gc_minor();
+  assert(!is_young(v) && !is_young(get_slot(v, 0)) && get_int(get_slot(get_slot(v, 2), 0)) == 2);
+  assert(allocated_count == 3 && young_top == kYoungBase);
+  size_t young = mk_pair(mk_int(3), 0);
+  set_slot(v, 1, young); // old to young, found by gc_minor through remembered
+  gc_minor();
+  assert(get_int(h(get_slot(v, 1))) == 3);
+  set_slot(v, 2, 0);
+  gc_collect(shadow_stack);
+  gc_finish_sweep();
+  assert(allocated_count == 3 && free_vectors[1].size() == 1);
+  nursery_enabled = false;
+  for (int i = 0; i < 100; i++)
+    mk_pair(0, 0);
+  size_t list = mk_pair(mk_int(4), mk_pair(mk_int(5), 0));
+  set_slot(v, 1, list);
+  gc_compact();
+  assert(vector_size(v) == 3 && get_int(h(get_slot(v, 0))) == 1 && list_sum(get_slot(v, 1)) == 9);
+  assert(t(get_slot(v, 1)) == get_slot(v, 1) + 1);
+  reset_allocator();
 }
 
-string format(size_t i) {
-  format_mark_refs(i);
-  return format_rec(i);
+void compaction_benchmark() {
+  const size_t kLength = size_t(1) << 22;
+  reset_allocator();
+  vector<size_t> cells(kLength);
+  for (auto& c : cells)
+    c = mk_pair(0, 0);
+  std::shuffle(cells.begin(), cells.end(), std::mt19937(42)); // scattered like a heap after many GC cycles
+  for (size_t i = 0; i < kLength; i++) {
+    vars[cells[i]].h = mk_int(1);
+    vars[cells[i]].t = i + 1 < kLength ? cells[i + 1] : 0;
+  }
+  Root root(cells[0]);
+  volatile int sum;
+  std::cout << "scattered list walk " << kLength << ": " << time_ms([&]{ sum = list_sum(root); }) << "ms" << std::endl;
+  std::cout << "compaction: " << time_ms([&]{ gc_compact(); }) << "ms" << std::endl;
+  std::cout << "compacted list walk " << kLength << ": " << time_ms([&]{ sum = list_sum(root); }) << "ms" << std::endl;
+  reset_allocator();
 }
 
+// -- visualization
+
 void visualization_test() {
   reset_allocator();
   assert(format(0) == ".");
@@ -224,9 +277,16 @@ void visualization_test() {
     mk_pair(mk_int(3), 0))) == "((1 2) 3 .)");
   reset_allocator();
   size_t a = mk_pair(mk_int(1), mk_int(2));
-  assert(format(mk_pair(a, a)) == "(d:(1 2) #d)");
+  assert(format(mk_pair(a, a)) == "(b:(1 2) #b)");
   vars[a].t = a;
-  assert(format(mk_pair(0, a)) == "(. d:(1 #d))");
+  assert(format(mk_pair(0, a)) == "(. b:(1 #b))");
+  gc_mark(a); // marks are separate from format's, so printing can happen mid-collection
+  assert(format(a) == "b:(1 #b)");
+  gc_sweep();
+  assert(allocated_count == 1);
+  size_t v = mk_vector(2);
+  set_slot(v, 0, mk_pair(mk_int(1), 0));
+  assert(format(v) == "[(1 .) .]");
 }
 
 // -- parsing
@@ -238,20 +298,25 @@ void skip_ws(const char*& pos) {
 
 bool is_num(char c) { return c >= '0' && c <= '9'; }
 const char error_marker = 0;
-const char * last_open_par;
+thread_local const char * last_open_par;
 
 size_t parse(const char*& pos) {
   skip_ws(pos);
   if (*pos == '(') {
     last_open_par = pos;
     pos++;
-    size_t r = 0;
-    for (size_t *d = &r; *pos !=')'; d = &vars[*d].t) {
+    Root r, last;
+    for (skip_ws(pos); *pos != ')'; skip_ws(pos)) {
       if (!*pos) {
         pos = &error_marker;
         return 0;
       }
-      *d = mk_pair(parse(pos), 0);
+      size_t item = mk_pair(parse(pos), 0);
+      if (last)
+        set_t(last, item);
+      else
+        r = item;
+      last = item;
     }
     pos++;
     return r;
@@ -275,302 +340,2927 @@ void parsing_test() {
   assert(pos != &error_marker && !*pos);
   assert(format(parse(pos = "(((a b) + a b) 2 3)")) == "(((a b .) + a b .) 2 3 .)");
   assert(pos != &error_marker && !*pos);
+  assert(format(parse(pos = "( a (b ) )")) == "(a (b .) .)");
 }
 
 
 // -- global_ctx
 
-enum {
-  tNil,
-  tLit, tIf, tAdd, tSub, tMul, tLt, tEq, tCon, tHead, tTail,
-  tLambda, tLet, tLetRec, // not used in continuation passing
-  tUser, // first user defined pair
-};
+bool inline_caches = true; // global references keep the slot found on their first use
 
-size_t reset_global_ctx() {
-  const char* const builtins[] = {"'", "?", "+", "-", "*", "<", "=", ".", "head", "tail", "lambda", "let", "letrec"};
-  reset_allocator();
-  size_t global_ctx = 1;
-  for (const auto n: builtins)
-    get_symbol(n);
-  for (const auto n: builtins){
-    size_t a = get_symbol(n);
-    global_ctx = mk_pair(mk_pair(a, a), global_ctx);
+size_t global_ref_slot(size_t ref) { // the inline cache of a reference: only its first use looks up global_slots
+  if (vars[ref].h == tGlobalSlot)
+    return vars[ref].t;
+  size_t slot = global_slot(vars[ref].t);
+  if (inline_caches) {
+    vars[ref].h = tGlobalSlot;
+    vars[ref].t = slot;
   }
-  return global_ctx;
+  return slot;
 }
 
-size_t lookup(size_t symbol, size_t ctx) {
-  for (; ctx; ctx = t(ctx)) {
-    size_t a = h(ctx);
-    if (h(a) == symbol)
-      return t(a);
+size_t parse_program(const char*& pos) { // top level forms, all but the last (define name initializer), nested as its body
+  Root r(parse(pos)), last;
+  last = r;
+  for (skip_ws(pos); *pos; skip_ws(pos)) {
+    if (h(last) != tDefine || !t(t(last)) || t(t(t(last))))
+      return r; // the caller reports the rest
+    size_t next = mk_pair(parse(pos), 0);
+    set_t(t(t(last)), next);
+    last = h(next);
   }
-  std::cerr << "unknown symbol " << (vars[symbol].h == tSymbol ? vars[symbol].s_name->c_str() : "???") << std::endl;
-  return 0;
+  return r;
 }
 
 void global_ctx_test() {
-  size_t ctx = reset_global_ctx();
-  assert(lookup(get_symbol("'"), ctx) == get_symbol("'"));
-  assert(lookup(get_symbol("tail"), ctx) == get_symbol("tail"));
+  assert(reset_global_ctx() == 0);
+  assert(get_symbol("'") == tLit);
+  assert(get_symbol("tail") == tTail);
+  assert(get_symbol("letrec") == tLetRec);
+  assert(get_symbol("define") == tDefine);
+  size_t a = global_slot(get_symbol("a")), b = global_slot(get_symbol("b"));
+  assert(a == 0 && b == 1 && global_slot(get_symbol("a")) == a);
+  assert(get_global(b) == 0);
+  for (int i = 0; i < 20; i++)
+    set_global(global_slot(get_symbol("g" + std::to_string(i))), mk_int(i));
+  set_global(a, mk_int(-1));
+  assert(get_int(get_global(a)) == -1 && get_int(get_global(global_slot(get_symbol("g19")))) == 19);
+  const char* pos;
+  assert(format(parse_program(pos = "(define a 1) (define b 2) (+ a b)")) == "(define a 1 (define b 2 (+ a b .) .) .)");
+  assert(!*pos);
+  parse_program(pos = "(+ 1 2) (+ 3 4)");
+  assert(*pos == '(');
+  reset_global_ctx();
 }
 
-// -- evaluation with continuation passing
+// -- constant folding
+// partial evaluation of the parsed program, before resolve: builtins applied to literals are folded,
+// ? with a known condition keeps one branch, and lambdas and lets given literals are inlined.
+// Allocations here don't collect, as evaluation hasn't started, so handles aren't rooted.
 
-size_t eval_param(size_t n, size_t ctx) {
-  return !n || vars[n].h == tNum ? n :
-    vars[n].h == tSymbol ? lookup(n, ctx) :
-    h(n) == tLit ? t(n) :
-    mk_pair(ctx, n);
+bool optimizing = true;
+thread_local bool builtins_rebound = false; // if the program binds builtin names, builtins and quotes can't be moved between scopes
+const size_t kUnknown = ~size_t(0); // value of a bound name that isn't a literal
+
+size_t apply_builtin(size_t fn, size_t a, size_t b, size_t c = 0);
+size_t optimize_call(size_t n, vector<std::pair<size_t, size_t>>& env);
+
+bool is_builtin_name(size_t s) { return s && s < tUser; }
+
+bool binds_builtin_name(size_t names) {
+  for (; names; names = t(names))
+    if (is_builtin_name(h(names)))
+      return true;
+  return false;
 }
 
-void jmp(size_t& n, size_t &ctx, size_t val) {
-  size_t cont = eval_param(h(t(t(t(n)))), ctx);
-  ctx = mk_pair(mk_pair(h(h(t(cont))), val), h(cont));
-  n = t(t(cont));
+bool rebinds_builtins(size_t n, bool cont_passing) { // n is an expression or a continuation passing call
+  if (!n || is_int(n) || vars[n].h == tSymbol || h(n) == tLit)
+    return false;
+  if (!cont_passing && h(n) == tLambda && binds_builtin_name(h(t(n))))
+    return true;
+  if (!cont_passing && (h(n) == tLet || h(n) == tLetRec || h(n) == tDefine) && is_builtin_name(h(t(n))))
+    return true;
+  for (; n; n = t(n)) {
+    size_t e = h(n);
+    if (!cont_passing ? rebinds_builtins(e, false) :
+        e && !is_int(e) && vars[e].h != tSymbol && h(e) != tLit && // lambda ((params) fn params...)
+        (binds_builtin_name(h(e)) || rebinds_builtins(t(e), true)))
+      return true;
+  }
+  return false;
 }
 
-size_t cont_eval(size_t n, size_t ctx) {
-  for (;;)
-  {
-    if (kSlotsCount - allocated_count < 20) {
-      gc_mark(n);
-      gc_mark(ctx);
-      gc_sweep();
+bool is_bound(size_t s, vector<std::pair<size_t, size_t>>& env) {
+  for (auto& b : env)
+    if (b.first == s)
+      return true;
+  return false;
+}
+
+bool is_builtin(size_t s, vector<std::pair<size_t, size_t>>& env) { return is_builtin_name(s) && !is_bound(s, env); }
+
+bool is_literal(size_t v) { // means the same in any scope
+  return !v || is_int(v) || (!builtins_rebound && (is_builtin_name(v) || h(v) == tLit));
+}
+
+bool is_lambda(size_t p) { // continuation passing param ((params) fn params...)
+  return p && !is_int(p) && vars[p].h != tSymbol && h(p) != tLit;
+}
+
+int truth(size_t c, vector<std::pair<size_t, size_t>>& env) { // of a condition, -1 if it isn't known
+  if (!c) return 0;
+  if (is_int(c) || is_builtin(c, env)) return 1;
+  if (vars[c].h != tSymbol && h(c) == tLit && is_builtin(tLit, env)) return t(c) ? 1 : 0;
+  return -1;
+}
+
+size_t optimize_symbol(size_t s, vector<std::pair<size_t, size_t>>& env) {
+  for (size_t i = env.size(); i--;)
+    if (env[i].first == s)
+      return env[i].second == kUnknown ? s : env[i].second;
+  return s;
+}
+
+template<typename F>
+size_t map_list(size_t l, F f) {
+  if (!l)
+    return 0;
+  size_t e = f(h(l));
+  return mk_pair(e, map_list(t(l), f));
+}
+
+bool all_literal(size_t l) {
+  for (; l; l = t(l))
+    if (!is_literal(h(l)))
+      return false;
+  return true;
+}
+
+size_t optimize_expr(size_t n, vector<std::pair<size_t, size_t>>& env) { // classic syntax
+  if (!n || is_int(n)) return n;
+  if (vars[n].h == tSymbol) return optimize_symbol(n, env);
+  auto optimize = [&](size_t e) { return optimize_expr(e, env); };
+  size_t fn = optimize_symbol(h(n), env), args = t(n), size = env.size();
+  if (is_builtin(fn, env)) {
+    switch (fn) {
+    case tLit: return fn != h(n) ? mk_pair(fn, args) : n; // the head may be an alias of '
+    case tIf: {
+      size_t c = optimize(h(args));
+      int known = truth(c, env);
+      if (known >= 0)
+        return optimize(h(known ? t(args) : t(t(args))));
+      return mk_pair(fn, mk_pair(c, map_list(t(args), optimize)));
     }
-    if (trace_eval) {
-      for (size_t c = ctx; c; c = t(c))
-        std::cout << "  " << format(h(h(c))) << " = " << format(t(h(c))) << "\n";
-      std::cout << "f: " << format(n) << std::endl;
+    case tAdd: case tSub: case tMul: case tLt: case tEq: {
+      size_t a = optimize(h(args)), b = optimize(h(t(args)));
+      size_t r = mk_pair(fn, mk_pair(a, mk_pair(b, 0)));
+      if (!is_int(a) || !is_int(b))
+        return r;
+      size_t v = apply_builtin(fn, a, b);
+      return v != fn ? v : is_builtin(tLit, env) ? mk_pair(tLit, v) : r; // true is the builtin, quoted so it stays a value
     }
-    size_t fn = eval_param(h(n), ctx);
-    switch (fn) // if (builtin_symbol params cont)
-    {
-      case tNil: return t(n) ? eval_param(h(t(n)), ctx) : t(h(ctx)); // value of last fn parameter
-      case tIf:
-        fn = eval_param(h(t(t(eval_param(h(t(n)), ctx) ? n : t(n)))), ctx);
-        ctx = h(fn);
-        n = t(t(fn));
-        if (!n) return fn;
-        continue;
-      case tAdd: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) + get_int(eval_param(h(t(t(n))), ctx)))); continue;
-      case tSub: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) - get_int(eval_param(h(t(t(n))), ctx)))); continue;
-      case tMul: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) * get_int(eval_param(h(t(t(n))), ctx)))); continue;
-      case tLt: jmp(n, ctx, get_int(eval_param(h(t(n)), ctx)) < get_int(eval_param(h(t(t(n))), ctx)) ? n : tNil); continue;
-      case tEq: jmp(n, ctx, get_int(eval_param(h(t(n)), ctx)) == get_int(eval_param(h(t(t(n))), ctx)) ? n : tNil); continue;
-      case tCon: jmp(n, ctx, mk_pair(eval_param(h(t(n)), ctx), eval_param(h(t(t(n))), ctx))); continue;
-      case tHead:
-        fn = eval_param(h(t(t(n))), ctx);
-        ctx = mk_pair(mk_pair(h(h(t(fn))), h(eval_param(h(t(n)), ctx))), h(fn));
-        n = t(t(fn));
-        continue;
-      case tTail:
-        fn = eval_param(h(t(t(n))), ctx);
-        ctx = mk_pair(mk_pair(h(h(t(fn))), t(eval_param(h(t(n)), ctx))), h(fn));
-        n = t(t(fn));
-        continue;
+    case tLambda: { // (lambda (params) body)
+      for (size_t p = h(args); p; p = t(p))
+        env.push_back({h(p), kUnknown});
+      size_t body = optimize(h(t(args)));
+      env.resize(size);
+      return mk_pair(fn, mk_pair(h(args), mk_pair(body, 0)));
     }
-    if (vars[fn].h == tNum)
-      return fn;
-    size_t callee_ctx = h(fn);    // (fn params), fn is (ctx (param_names) delegate_fn dfn param)
-    for (size_t actual = t(n), formal = h(t(fn)); actual && formal; actual = t(actual), formal = t(formal))
-      callee_ctx = mk_pair(mk_pair(h(formal), eval_param(h(actual), ctx)), callee_ctx);
-    ctx = callee_ctx;
-    n = t(t(fn));
+    case tLet: case tLetRec: { // (let name initializer body), inlined if the initializer is a literal
+      if (fn == tLetRec)
+        env.push_back({h(args), kUnknown});
+      size_t init = optimize(h(t(args)));
+      if (fn == tLet)
+        env.push_back({h(args), is_literal(init) ? init : kUnknown});
+      size_t body = optimize(h(t(t(args))));
+      env.resize(size);
+      if (fn == tLet && is_literal(init))
+        return body;
+      return mk_pair(fn, mk_pair(h(args), mk_pair(init, mk_pair(body, 0))));
+    }
+    case tDefine: { // (define name initializer body), globals can be redefined, so they aren't inlined
+      size_t init = optimize(h(t(args)));
+      return mk_pair(fn, mk_pair(h(args), mk_pair(init, map_list(t(t(args)), optimize))));
+    }
+    }
+  }
+  if (h(fn) == tLambda && is_builtin(tLambda, env)) { // ((lambda (params) body) literals...) is its body
+    size_t values = map_list(args, optimize);
+    if (!all_literal(values))
+      return mk_pair(optimize(fn), values);
+    for (size_t p = h(t(fn)); p; p = t(p), values = t(values))
+      env.push_back({h(p), h(values)}); // missing ones are nil, as in eval
+    size_t body = optimize(h(t(t(fn))));
+    env.resize(size);
+    return body;
   }
+  return map_list(n, optimize);
 }
 
-int cont_compile_eval(const char* s) {
-  size_t ctx = reset_global_ctx();
-  size_t fn = parse(s);
-  return s == &error_marker || *s ? printf("error at %s", s), -1 : get_int(cont_eval(fn, ctx));
+size_t optimize_param(size_t p, vector<std::pair<size_t, size_t>>& env) {
+  if (!p || is_int(p)) return p;
+  if (vars[p].h == tSymbol) return optimize_symbol(p, env);
+  if (h(p) == tLit) return p;
+  size_t size = env.size();
+  for (size_t q = h(p); q; q = t(q))
+    env.push_back({h(q), kUnknown});
+  size_t call = optimize_call(t(p), env);
+  env.resize(size);
+  return mk_pair(h(p), call);
 }
 
-// -- classic evaluation
+size_t apply_lambda(size_t lambda, size_t values, vector<std::pair<size_t, size_t>>& env) { // its call with params bound
+  size_t size = env.size();
+  for (size_t p = h(lambda); p; p = t(p), values = t(values))
+    env.push_back({h(p), h(values)}); // missing ones are nil, as in cont_eval
+  size_t r = optimize_call(t(lambda), env);
+  env.resize(size);
+  return r;
+}
 
-struct gc_guard{
-  static gc_guard* root;
-  size_t f = 0, ctx = 0, temp = 0, temp1 = 0;
-  gc_guard*prev;
-  gc_guard() : prev(root) { root = this; }
-  ~gc_guard() { root = prev; }
-  void set(size_t f, size_t ctx) {
-    this->f = f;
-    this->ctx = ctx;
-    this->temp = this->temp = 0;
-  }
-};
-gc_guard* gc_guard::root = nullptr;
+size_t continue_with(size_t k, size_t value, vector<std::pair<size_t, size_t>>& env) { // kUnknown if it can't be folded
+  if (is_lambda(k))
+    return apply_lambda(k, mk_pair(value, 0), env);
+  k = optimize_param(k, env);
+  if (!k || (!is_int(k) && vars[k].h == tSymbol && !is_builtin(k, env))) // nil returns value, a variable is called
+    return mk_pair(k, mk_pair(value, 0));
+  return kUnknown;
+}
 
-size_t eval(size_t n, size_t ctx) {
-  gc_guard guard;
-  for (;;) {
-    guard.set(n, ctx);
-    if (kSlotsCount - allocated_count < 20) {
-      for (gc_guard* i = gc_guard::root; i ; i = i->prev) {
-        gc_mark(i->f);
-        gc_mark(i->ctx);
-        gc_mark(i->temp);
-        gc_mark(i->temp1);
-      }
-      gc_sweep();
+size_t optimize_call(size_t n, vector<std::pair<size_t, size_t>>& env) { // continuation passing syntax
+  auto optimize = [&](size_t p) { return optimize_param(p, env); };
+  size_t args = t(n);
+  if (is_lambda(h(n))) { // (((params) fn params...) literals...) is the call in the lambda
+    size_t values = map_list(args, optimize);
+    return all_literal(values) ? apply_lambda(h(n), values, env) : mk_pair(optimize(h(n)), values);
+  }
+  size_t fn = optimize(h(n));
+  if (is_builtin(fn, env)) {
+    switch (fn) {
+    case tIf: { // (? condition then else), the branch is entered with nil
+      size_t c = optimize(h(args));
+      int known = truth(c, env);
+      size_t r = known < 0 ? kUnknown : continue_with(h(known ? t(args) : t(t(args))), 0, env);
+      if (r != kUnknown)
+        return r;
+      return mk_pair(fn, mk_pair(c, map_list(t(args), optimize)));
     }
-    if (trace_eval) {
-      for (size_t c = ctx; c; c = t(c))
-        std::cout << "  " << format(h(h(c))) << " = " << format(t(h(c))) << "\n";
-      std::cout << "f: " << format(n) << std::endl;
+    case tAdd: case tSub: case tMul: case tLt: case tEq: { // (op a b continuation)
+      size_t a = optimize(h(args)), b = optimize(h(t(args)));
+      size_t v = is_int(a) && is_int(b) ? apply_builtin(fn, a, b) : kUnknown; // true is the builtin, as in threaded_run
+      size_t r = v != kUnknown && is_literal(v) ? continue_with(h(t(t(args))), v, env) : kUnknown;
+      if (r != kUnknown)
+        return r;
+      return mk_pair(fn, mk_pair(a, mk_pair(b, map_list(t(t(args)), optimize))));
     }
-    if (!n || vars[n].h == tNum) return n;
-    if (vars[n].h == tSymbol) return lookup(n, ctx);
-    size_t fn = guard.temp = eval(h(n), ctx);
-    switch (fn) {
-    case tLit: return t(n);
-    case tIf: n = h(t(t(eval(h(t(n)), ctx) ? n : t(n)))); continue;
-    case tAdd: return mk_int(get_int(eval(h(t(n)), ctx)) + get_int(eval(h(t(t(n))), ctx)));
-    case tSub: return mk_int(get_int(eval(h(t(n)), ctx)) - get_int(eval(h(t(t(n))), ctx)));
-    case tMul: return mk_int(get_int(eval(h(t(n)), ctx)) * get_int(eval(h(t(t(n))), ctx)));
-    case tLt: return get_int(eval(h(t(n)), ctx)) < get_int(eval(h(t(t(n))), ctx)) ? n : 0;
-    case tEq: return get_int(eval(h(t(n)), ctx)) == get_int(eval(h(t(t(n))), ctx)) ? n : 0;
-    case tCon:
-      guard.temp = eval(h(t(n)), ctx);
-      return mk_pair(guard.temp, eval(h(t(t(n))), ctx));
-    case tHead: return h(eval(h(t(n)), ctx));
-    case tTail: return t(eval(h(t(n)), ctx));
-    case tLambda: return mk_pair(ctx, t(n));
-    case tLet: // (let name initializer body)
-      ctx = mk_pair(
-          mk_pair(h(t(n)),
-            eval(h(t(t(n))), ctx)),
-          ctx);
-      n = h(t(t(t(n))));
-      continue;
-    case tLetRec:
-      ctx = guard.temp = mk_pair(mk_pair(h(t(n)), 0), ctx);
-      vars[h(ctx)].t = eval(h(t(t(n))), ctx);
-      n = h(t(t(t(n))));
-      continue;
     }
-    size_t callee_ctx = h(fn);    // (fn params), fn is (ctx (param_names) body)
-    for (size_t actual = t(n), formal = h(t(fn)); actual && formal; actual = t(actual), formal = t(formal))
-      callee_ctx = guard.temp1 = mk_pair(mk_pair(h(formal), eval(h(actual), ctx)), callee_ctx);
-    ctx = callee_ctx;
-    n = h(t(t(fn)));
   }
+  return mk_pair(fn, map_list(args, optimize));
 }
 
-int compile_eval(const char* s) {
-  size_t ctx = reset_global_ctx();
-  size_t fn = parse(s);
-  return s == &error_marker || *s ? printf("error at %s", s), -1 : get_int(eval(fn, ctx));
+size_t optimize(size_t program, bool cont_passing) {
+  if (cont_passing && (!program || is_int(program) || vars[program].h == tSymbol))
+    return program;
+  builtins_rebound = rebinds_builtins(program, cont_passing);
+  vector<std::pair<size_t, size_t>> env;
+  return cont_passing ? optimize_call(program, env) : optimize_expr(program, env);
 }
 
-void cont_eval_test() {
-  assert(2 == cont_compile_eval("(- 3 1)"));
-  assert(4 == cont_compile_eval("(- 3 1 ((x) + x x))")); // x=3-1; x+x
-  assert(5 == cont_compile_eval("(((a b) + a b) 2 3)")); // ((lambda (a b) (+ a b)) 2 3)
-  assert(5 == cont_compile_eval("(< 3 1 ((a) ? a 2 5))")); // if 3<1 :2 :5
-  assert(4 == cont_compile_eval(R"-(
-    (((len) len (' 1 2 3 4) nil)
-      ((list r)
-        ((lnrec) lnrec 0  list lnrec r)
-        ((c l f r)
-          ? l
-            (() tail l ((tl) + 1 c ((inc) f inc tl f r)))
-            (() r c))
-      )
-    ))-"));
+void optimize_test() {
+  reset_global_ctx();
+  const char* pos;
+  auto optimized = [&](const char* s, bool cont_passing) { return format(optimize(parse_program(pos = s), cont_passing)); };
+  assert(optimized("(+ 3 1)", false) == "4");
+  assert(optimized("(? (< 3 1) a b)", false) == "b");
+  assert(optimized("(< 1 3)", false) == "(' <)");
+  assert(optimized("((lambda (a b) (+ a b)) 2 3)", false) == "5");
+  assert(optimized("(let x (- 3 1) (+ x x))", false) == "4");
+  assert(optimized("(let f + (f 1 (? (' 1) 2 3)))", false) == "3");
+  assert(optimized("(let q ' (q 1 2))", false) == "(' 1 2 .)");
+  assert(optimized("(let x 1 (lambda (x) (+ x 1)))", false) == "(lambda (x .) (+ x 1 .) .)");
+  assert(optimized("(let + 1 (+ 2 3))", false) == "(1 2 3 .)");
+  assert(optimized("(letrec f (lambda (n) (? (< n 1) 0 (f (- n 1)))) (f (* 2 5)))", false) ==
+    "(letrec f (lambda (n .) (? (< n 1 .) 0 (f (- n 1 .) .) .) .) (f 10 .) .)");
+  assert(optimized("(define x 1) (+ x (let y 2 y))", false) == "(define x 1 (+ x 2 .) .)");
+  assert(optimized("(- 3 1 ((x) + x x))", true) == "(. 4 .)");
+  assert(optimized("(((a b) + a b) 2 3)", true) == "(. 5 .)");
+  assert(optimized("(< 3 1 ((c) ? c (() k 1) (() k 2)))", true) == "(k 2 .)");
+  assert(optimized("(< 1 3 ((c) ? c (() k 1) (() k 2)))", true) == "(k 1 .)");
+  assert(optimized("(((n) + n (* 2 2 ((m) m)) ((r) k r)) x)", true) == "(((n .) + n (* 2 2 ((m .) m .) .) ((r .) k r .) .) x .)");
+  assert(optimized("(((+) + 1 2 ((r) r)) 5)", true) == "(5 1 2 ((r .) r .) .)"); // + is a param
+  reset_global_ctx();
 }
 
-void eval_test() {
-  assert(2 == compile_eval("(- 3 1)"));
-  assert(4 == compile_eval("(let x (- 3 1) (+ x x))"));
-  assert(5 == compile_eval("((lambda (a b) (+ a b)) 2 3)"));
-  assert(5 == compile_eval("(? (< 3 1) 2 5)"));
-  assert(4 == compile_eval(R"-(
-    (letrec len
-      (lambda (l)
-        (? l
-          (+ 1 (len (tail l)))
-          0
-        )
-      )
-      (len (' 1 2 3 4))
-    ))-"));
-  assert(4 == compile_eval(R"-(
-    (let len
-      (lambda (list)
-        (letrec len_r
-          (lambda (c l)
-            (? l
-              (len_r (+ 1 c) (tail l))
-              c
-            )
-          )
-          (len_r 0 list)
-        )
-      )
-      (len (' 1 2 3 4))
-    ))-"));
+// -- closure conversion
+// A call runs in a frame, a vector of the callee closure, its params and then its lets.
+// A closure is a vector of its lambda and the values of the lambda's free variables, so it keeps only those alive.
+// resolve replaces each variable reference with a slot in the frame or in its closure,
+// and the params of each lambda with (param_count frame_size references_to_capture...).
+// In continuation passing, a lambda passed as the continuation of a builtin can't escape, as the builtin just calls it,
+// so it runs in the frame of its caller, with its param in a slot there, like a let: ($slot fn params...), or (nil fn params...).
+
+size_t lookup(size_t ref, size_t frame) {
+  return get_slot(vars[ref].h == tLocal ? frame : get_slot(frame, 0), vars[ref].t);
 }
 
-void show_help() {
-   std::cout <<
-     "little-lisp" << std::endl <<
-     "usage: ll -flags \"expression or filename\"" << std::endl <<
-     "where flags are:" << std::endl <<
-     "  t - run self tests" << std::endl <<
-     "  h - this help" << std::endl <<
-     "  g - show gc statistics" << std::endl <<
-     "  v - varbose evaluation trace" << std::endl <<
-     std::endl <<
-     "  p - continuation passing mode (default)" << std::endl <<
-     "  c - or classic mode" << std::endl <<
-     std::endl <<
-     "  r - return value as errorlevel" << std::endl <<
-     "  o - or return value to stdout (default)" << std::endl <<
-     std::endl <<
-     "  i - command line is an expression (default)" << std::endl <<
-     "  f - or command line is a file name" << std::endl;
+size_t param_count(size_t info) { return get_int(h(info)); }
+size_t frame_size(size_t info) { return get_int(h(t(info))); }
+
+size_t mk_closure(size_t lambda, size_t info, size_t frame) { // lambda and frame are rooted by the caller
+  size_t count = 1;
+  for (size_t c = t(t(info)); c; c = t(c))
+    count++;
+  size_t r = mk_vector(count);
+  uint32_t* s = new_slots(r);
+  *s++ = lambda;
+  for (size_t c = t(t(info)); c; c = t(c))
+    *s++ = lookup(h(c), frame);
+  return r;
 }
 
-int main(int param_cnt, const char* const* params) {
-  if (param_cnt < 2) {
-    std::cerr << "help: ll -h" << std::endl;
-    rexit(1);
-  }
-  bool immediate_mode = true;
-  bool to_result_code = false;
-  while (param_cnt > 1 && *params[1] == '-') {
-    params++;
-    for (const char* p = *params; *++p;) {
-      switch(*p) {
-      case 't':
-        allocator_test();
-        gc_test();
-        global_ctx_test();
-        visualization_test();
-        parsing_test();
-        eval_test();
-        cont_eval_test();
-        std::cout << "tests passed" << std::endl;
-        rexit(1);
-      case 'g': trace_gc = true; break;
-      case 'v': trace_eval = true; break;
-      case 'c': cont_passing_mode = false; break;
-      case 'p': cont_passing_mode = true; break;
-      case 'i': immediate_mode = true; break;
-      case 'f': immediate_mode = false; break;
-      case 'h': show_help(); rexit(0);
-      case 'r': to_result_code = true; break;
-      case 'o': to_result_code = false; break;
-      default:
-        std::cerr << "unknown flag '" << *p << "'" << std::endl;
-        rexit(-1);
+struct Scope { // variables of the lambda being converted
+  Scope* outer;
+  vector<std::pair<size_t, size_t>> locals; // symbol and slot in the frame, innermost last
+  size_t top = 1, size = 1; // first free slot and the frame size, slot 0 is the closure
+  vector<size_t> captured; // symbols in the closure slots from 1
+  vector<size_t> captures; // their references in outer, for mk_closure
+  vector<std::pair<size_t, bool>> unset; // slots of letrecs whose initializer is being resolved, and if a lambda captured it
+
+  explicit Scope(Scope* outer) : outer(outer) {}
+};
+
+size_t resolve_symbol(size_t s, Scope& scope, bool inner = false) { // inner when a lambda in scope captures s
+  for (size_t i = scope.locals.size(); i--;) {
+    if (scope.locals[i].first != s)
+      continue;
+    for (auto& u : scope.unset)
+      if (u.first == scope.locals[i].second) {
+        if (!inner)
+          return 0; // nil until the initializer is done, as the closures get the value by patch_letrec
+        u.second = true;
+      }
+    return mk_ref(tLocal, scope.locals[i].second);
+  }
+  for (size_t i = 0; i < scope.captured.size(); i++)
+    if (scope.captured[i] == s)
+      return mk_ref(tCaptured, i + 1);
+  if (scope.outer) {
+    size_t ref = resolve_symbol(s, *scope.outer, true);
+    if (ref < tUser || vars[ref].h == tGlobal) // builtin, global or unknown
+      return ref;
+    scope.captured.push_back(s);
+    scope.captures.push_back(ref);
+    return mk_ref(tCaptured, scope.captured.size());
+  }
+  if (s < tUser)
+    return s;
+  if (global_slots.count(s))
+    return mk_ref(tGlobal, s);
+  std::cerr << "unknown symbol " << symbol_name(s) << std::endl;
+  return 0;
+}
+
+void add_params(Scope& scope, size_t params) {
+  for (; params; params = t(params))
+    scope.locals.push_back({h(params), scope.size++});
+  scope.top = scope.size;
+}
+
+size_t lambda_info(Scope& scope) { // (param_count frame_size captures...), scope.top is past the params
+  Root r;
+  for (size_t i = scope.captures.size(); i--;)
+    r = mk_pair(scope.captures[i], r);
+  r = mk_pair(mk_int(scope.size), r);
+  return mk_pair(mk_int(scope.top - 1), r);
+}
+
+size_t alias_of(size_t s, vector<std::pair<size_t, size_t>>& env) { // the special form let bound to s, else kUnknown
+  for (size_t i = env.size(); i--;)
+    if (env[i].first == s)
+      return env[i].second;
+  return kUnknown;
+}
+
+void unalias(size_t n, vector<std::pair<size_t, size_t>>& env) { // classic syntax, calls of an alias of a special form get the form
+  if (!n || is_int(n) || vars[n].h == tSymbol)
+    return;
+  size_t fn = h(n), args = t(n), size = env.size();
+  if (fn && !is_int(fn) && vars[fn].h == tSymbol) {
+    size_t form = alias_of(fn, env);
+    if (form != kUnknown && is_builtin(form, env))
+      set_h(n, fn = form);
+  }
+  switch (is_builtin(fn, env) ? fn : size_t(tUser)) {
+  case tLit: return;
+  case tLambda: // (lambda (params) body)
+    for (size_t p = h(args); p; p = t(p))
+      env.push_back({h(p), kUnknown});
+    unalias(h(t(args)), env);
+    break;
+  case tLet: case tLetRec: case tDefine: { // (let name initializer body)
+    size_t name = h(args), init = h(t(args)), form = kUnknown;
+    if (fn == tLetRec)
+      env.push_back({name, kUnknown});
+    unalias(init, env);
+    if (init && !is_int(init) && vars[init].h == tSymbol)
+      form = is_builtin(init, env) ? init : alias_of(init, env);
+    if (form != tLit && form != tIf && (form < tLambda || form > tDefine)) // whose params aren't all evaluated
+      form = kUnknown;
+    if (fn != tLetRec)
+      env.push_back({name, form});
+    unalias(h(t(t(args))), env);
+    break;
+  }
+  default:
+    for (; args; args = t(args))
+      unalias(h(args), env);
+    unalias(fn, env);
+  }
+  env.resize(size);
+}
+
+size_t resolve_expr(size_t n, Scope& scope, size_t self = 0);
+
+void resolve_at(size_t pair, Scope& scope, size_t self = 0) {
+  if (pair)
+    set_h(pair, resolve_expr(h(pair), scope, self));
+}
+
+size_t resolve_expr(size_t n, Scope& scope, size_t self) { // classic syntax, self names a lambda defined by letrec
+  if (!n || is_int(n)) return n;
+  if (vars[n].h == tSymbol) return resolve_symbol(n, scope);
+  resolve_at(n, scope);
+  size_t args = t(n);
+  switch (h(n)) { // a shadowed builtin is a reference here, so its form is an ordinary call
+  case tLit: return n;
+  case tLambda: { // (lambda (params) body)
+    Scope inner{&scope};
+    if (self) // the closure is in slot 0 of its frame
+      inner.locals.push_back({self, 0});
+    add_params(inner, h(args));
+    resolve_at(t(args), inner);
+    set_h(args, lambda_info(inner));
+    return n;
+  }
+  case tLet: case tLetRec: { // (let name initializer body), name is appended when closures need patch_letrec
+    std::pair<size_t, size_t> local{h(args), scope.top++};
+    size_t init = h(t(args));
+    bool unset = h(n) == tLetRec && !(init && !is_int(init) && vars[init].h != tSymbol && h(init) == tLambda);
+    scope.size = std::max(scope.size, scope.top);
+    if (h(n) == tLetRec)
+      scope.locals.push_back(local);
+    if (unset)
+      scope.unset.push_back({local.second, false});
+    resolve_at(t(args), scope, h(n) == tLetRec ? local.first : 0);
+    bool patch = unset && scope.unset.back().second;
+    if (unset)
+      scope.unset.pop_back();
+    if (h(n) == tLet)
+      scope.locals.push_back(local);
+    resolve_at(t(t(args)), scope);
+    scope.locals.pop_back();
+    scope.top--;
+    set_h(args, mk_ref(tLocal, local.second));
+    if (patch)
+      set_t(t(t(args)), mk_pair(local.first, 0));
+    return n;
+  }
+  case tDefine: // (define name initializer body), the name is global from here on
+    global_slot(h(args));
+    set_h(args, mk_ref(tGlobal, h(args)));
+    resolve_at(t(args), scope);
+    resolve_at(t(t(args)), scope);
+    return n;
+  }
+  for (; args; args = t(args))
+    resolve_at(args, scope);
+  return n;
+}
+
+bool frame_continuations = true; // continuations of builtins run in the frame of their caller
+
+void resolve_call(size_t n, Scope& scope);
+
+size_t resolve_param(size_t n, Scope& scope) { // continuation passing syntax
+  if (!n || is_int(n)) return n;
+  if (vars[n].h == tSymbol) return resolve_symbol(n, scope);
+  if (h(n) == tLit) return n;
+  Scope inner{&scope}; // lambda ((params) fn params...)
+  add_params(inner, h(n));
+  resolve_call(t(n), inner);
+  set_h(n, lambda_info(inner));
+  return n;
+}
+
+bool in_frame(size_t cont) { // a continuation resolved to run in the frame of its caller
+  return cont && !is_imm(cont) && vars[cont].h < tVal && (!h(cont) || (!is_imm(h(cont)) && vars[h(cont)].h == tLocal));
+}
+
+void resolve_call(size_t n, Scope& scope) { // (fn params...)
+  set_h(n, resolve_param(h(n), scope));
+  size_t fn = h(n), i = 0;
+  bool builtin = fn >= tIf && fn <= tTail; // not shadowed, as a shadowed one is a reference by now
+  for (size_t p = t(n); p; p = t(p)) {
+    size_t cont = h(p);
+    i++;
+    if (!builtin || !frame_continuations || (fn == tIf ? i == 1 : i != (fn < tHead ? 3 : 2)) || !cont || is_imm(cont) ||
+        vars[cont].h >= tVal || h(cont) == tLit || (h(cont) && t(h(cont)))) { // or a lambda with more than one param
+      set_h(p, resolve_param(cont, scope));
+      continue;
+    }
+    std::pair<size_t, size_t> local{h(h(cont)), scope.top};
+    if (h(cont)) {
+      scope.top++;
+      scope.size = std::max(scope.size, scope.top);
+      scope.locals.push_back(local);
+    }
+    resolve_call(t(cont), scope);
+    if (h(cont)) {
+      scope.locals.pop_back();
+      scope.top--;
+      set_h(cont, mk_ref(tLocal, local.second));
+    }
+  }
+}
+
+size_t resolve(size_t program, bool cont_passing) { // the program runs with a nil frame, so one with lets is wrapped in a lambda
+  Root r(program);
+  Scope top{nullptr};
+  if (cont_passing) {
+    resolve_call(r, top);
+    if (top.size == 1)
+      return r;
+    top.top = 1;
+    r = mk_pair(lambda_info(top), r);
+    return mk_pair(r, 0);
+  }
+  for (size_t d = r; h(d) == tDefine; d = h(t(t(t(d))))) // top level defines can refer to each other
+    global_slot(h(t(d)));
+  vector<std::pair<size_t, size_t>> env;
+  unalias(r, env);
+  r = resolve_expr(r, top);
+  if (top.size == 1)
+    return r;
+  top.top = 1;
+  r = mk_pair(lambda_info(top), mk_pair(r, 0));
+  r = mk_pair(tLambda, r);
+  return mk_pair(r, 0);
+}
+
+void resolve_test() {
+  reset_global_ctx();
+  const char *pos;
+  assert(format(resolve(parse(pos = "((lambda (a b) (+ a b)) 2 3)"), false)) == "((lambda (2 3 .) (+ $1 $2 .) .) 2 3 .)");
+  assert(format(resolve(parse(pos = "(let + 1 (let x (+ 2) (x +)))"), false)) ==
+    "((lambda (0 3 .) (let $1 1 (let $2 ($1 2 .) ($2 $1 .) .) .) .) .)");
+  assert(format(resolve(parse(pos = "(letrec f (lambda (x) (f (' x))) f)"), false)) ==
+    "((lambda (0 2 .) (letrec $1 (lambda (1 2 .) ($0 (' x .) .) .) $1 .) .) .)");
+  assert(format(resolve(parse(pos = "(lambda (a) (lambda (b) (lambda (c) (+ a c))))"), false)) ==
+    "(lambda (1 2 .) (lambda (1 2 $1 .) (lambda (1 2 ^1 .) (+ ^1 $1 .) .) .) .)");
+  assert(format(resolve(parse(pos = "(((a b) + a b) 2 3)"), true)) == "(((2 3 .) + $1 $2 .) 2 3 .)");
+  assert(format(resolve(parse(pos = "(- 3 1 ((x) + x (' 5) ((y) * x y)))"), true)) ==
+    "(((0 3 .) - 3 1 ($1 + $1 (' 5 .) ($2 * $1 $2 .) .) .) .)"); // continuations of builtins run in the frame
+  assert(format(resolve(parse(pos = "(((f) - 3 1 ((x) f ((y) * x y))) ((k) k 2))"), true)) ==
+    "(((1 3 .) - 3 1 ($2 $1 ((1 2 $2 .) * ^1 $1 .) .) .) ((1 2 .) $1 2 .) .)"); // one passed to f is a closure
+  assert(format(resolve(parse_program(pos = "(define sq (lambda (x) (* x x))) (define y (sq 2)) (sq y)"), false)) ==
+    "(define sq (lambda (1 2 .) (* $1 $1 .) .) (define y (sq 2 .) (sq y .) .) .)");
+}
+
+// -- quickening
+// The evaluators rewrite a node in place on its first run, into a form that runs with fewer checks:
+// (quick + a b) when both operands are slots or int literals, and (quick call (fn_ref . lambda) params...)
+// when fn_ref held a closure of lambda. Each form has a guard, and goes back to the generic node when it fails.
+
+bool quickening = true;
+
+bool is_slot(size_t p) { return p && !is_imm(p) && (vars[p].h == tLocal || vars[p].h == tCaptured); }
+bool is_simple(size_t p) { return is_imm(p) || is_slot(p); } // read without dispatch
+
+size_t simple_value(size_t p, size_t ctx) { return is_imm(p) ? p : lookup(p, ctx); }
+
+bool is_global_ref(size_t p) { return p && !is_imm(p) && (vars[p].h == tGlobal || vars[p].h == tGlobalSlot); }
+
+void quicken_op(size_t n, size_t ctx) { // (+ a b) or (+ a b k), when a and b are now ints in slots or literals
+  size_t a = h(t(n)), b = h(t(t(n)));
+  if (quickening && h(n) >= tAdd && h(n) <= tEq && is_simple(a) && is_simple(b) &&
+      is_imm(simple_value(a, ctx)) && is_imm(simple_value(b, ctx)))
+    set_h(n, h(n) - tAdd + qAdd);
+}
+
+void quicken_call(size_t n, size_t fn) { // (fn_ref params...), fn is the closure fn_ref held
+  if (quickening && (is_slot(h(n)) || is_global_ref(h(n)))) {
+    size_t known = mk_pair(mk_pair(h(n), get_slot(fn, 0)), t(n));
+    set_t(n, known);
+    set_h(n, qCall);
+  }
+}
+
+size_t known_callee(size_t n, size_t ctx) { // of (quick call (fn_ref . lambda) params...), or kUnknown
+  size_t ref = h(h(t(n))), fn = is_slot(ref) ? lookup(ref, ctx) : get_global(global_ref_slot(ref));
+  return is_vector(fn) && get_slot(fn, 0) == t(h(t(n))) ? fn : kUnknown;
+}
+
+void despecialize(size_t n) { // a quickened node whose guard failed goes back to its generic form
+  if (h(n) == qCall) {
+    size_t ref = h(h(t(n)));
+    set_t(n, t(t(n)));
+    set_h(n, ref);
+  } else
+    set_h(n, h(n) - qAdd + tAdd);
+}
+
+bool quick_op(size_t n, size_t ctx, size_t& value) { // (quick + a b), false if an operand isn't an immediate int
+  size_t a = simple_value(h(t(n)), ctx), b = simple_value(h(t(t(n))), ctx);
+  if (!is_imm(a) || !is_imm(b))
+    return false;
+  int x = get_int(a), y = get_int(b);
+  switch (h(n)) {
+  case qAdd: value = mk_int(x + y); break;
+  case qSub: value = mk_int(x - y); break;
+  case qMul: value = mk_int(x * y); break;
+  case qLt: value = x < y ? tLt : 0; break;
+  default: value = x == y ? tEq : 0;
+  }
+  return true;
+}
+
+// -- green threads
+// The whole state of a continuation passing program is (n, ctx), so cont_eval runs many threads in one heap:
+// (spawn fn k) queues a thread entering fn and passes its id to k, (yield k) lets the ready threads run first,
+// (chan k) makes a channel, (send channel value k) gives value to a waiting receiver or queues it,
+// and (recv channel k) waits for a value. The program ends when thread 0, the one it started with, does.
+
+size_t time_slice = 1000; // steps a thread runs while others are ready
+thread_local size_t context_switches = 0;
+
+void enqueue(size_t queue, size_t value) { // queue is (first . last) of a list, rooted by the caller
+  size_t p = mk_pair(value, 0);
+  if (t(queue))
+    set_t(t(queue), p);
+  else
+    set_h(queue, p);
+  set_t(queue, p);
+}
+
+size_t dequeue(size_t queue) { // nil if it's empty
+  size_t p = h(queue);
+  if (!p)
+    return 0;
+  set_h(queue, t(p));
+  if (!t(p))
+    set_t(queue, 0);
+  return h(p);
+}
+
+size_t mk_channel() { // queues of values and of waiting receivers
+  Root values(mk_pair(0, 0)); // the next mk_pair may collect
+  return mk_pair(values, mk_pair(0, 0));
+}
+
+struct Scheduler { // the threads of one cont_eval, each is (id n . ctx)
+  Root ready; // queue of threads, nil until the first spawn
+  size_t current = 0, next_id = 1, steps = 0; // the id of the running thread and the steps of its slice
+
+  size_t mk_thread(size_t id, size_t n, size_t ctx) { return mk_pair(mk_int(id), mk_pair(n, ctx)); }
+  bool others_ready() { return ready && h(ready); }
+  size_t spawn(size_t n, size_t ctx) { // non-moving allocations, so n and ctx stay valid
+    if (!ready)
+      ready = mk_pair(0, 0);
+    enqueue(ready, mk_thread(next_id, n, ctx));
+    return next_id++;
+  }
+  void wake(size_t id, size_t n, size_t ctx) { enqueue(ready, mk_thread(id, n, ctx)); }
+  size_t suspend(size_t n, size_t ctx) { return mk_thread(current, n, ctx); } // the running thread, to be queued
+  bool resume(Root& n, Root& ctx) { // switches to the next ready thread, false if there is none
+    size_t thread = ready ? dequeue(ready) : 0;
+    if (!thread)
+      return false;
+    current = get_int(h(thread));
+    n = h(t(thread));
+    ctx = t(t(thread));
+    steps = 0;
+    context_switches++;
+    return true;
+  }
+  void switch_thread(Root& n, Root& ctx) { // preemption or yield, when others are ready
+    enqueue(ready, suspend(n, ctx));
+    resume(n, ctx);
+  }
+};
+
+size_t deadlock() {
+  std::cerr << "deadlock: all green threads wait on channels" << std::endl;
+  return 0;
+}
+
+// -- futures
+// (future fn k) calls fn with a nil continuation on a worker thread and passes a future to k, (touch future k) waits
+// for its value, and (pmap fn list k) calls fn with each item and a nil continuation on the workers.
+// Each worker has a heap of its own, so fn must be pure, with no globals or channels: it and its params are copied
+// into a Message, rebuilt in the heap of the worker, and the result comes back the same way, rebuilt by the thread
+// that waits for it. A worker takes tasks from the back of its deque, and when that is empty, from the front of another.
+
+size_t cont_eval(size_t node, size_t context);
+void release_thread();
+
+struct Message { // values copied out of a heap, see Exporter and import_values
+  vector<Var> cells; // a handle to cell i is tUser + i, nil, builtins and immediates are as they are
+  vector<uint32_t> slots; // of each (tVector . offset): the slot count, then the slots
+  string names; // of each (tSymbol . offset): the zero-terminated name
+  vector<std::shared_ptr<Task>> tasks; // of each (tTask . index), so a future can be touched in another heap
+  vector<uint32_t> values;
+};
+
+struct Exporter { // copies values to m, with their shared cells and cycles
+  Message& m;
+  unordered_map<size_t, uint32_t> copied; // handle to handle in m
+  vector<size_t> pending; // cells with a handle in m, but not their contents yet
+
+  explicit Exporter(Message& m) : m(m) {}
+
+  uint32_t handle(size_t v) {
+    if (v < tUser || is_imm(v))
+      return v;
+    auto c = copied.find(v);
+    if (c != copied.end())
+      return c->second;
+    uint32_t r = tUser + m.cells.size();
+    m.cells.push_back({0, 0});
+    pending.push_back(v);
+    return copied[v] = r;
+  }
+  void add(size_t v) {
+    m.values.push_back(handle(v));
+    while (!pending.empty()) {
+      size_t c = pending.back();
+      pending.pop_back();
+      Var cell = vars[c];
+      if (cell.h == tSymbol) {
+        cell.t = m.names.size();
+        m.names.append(symbol_name(c)).push_back(0);
+      } else if (cell.h == tVector) {
+        size_t n = vector_size(c);
+        cell.t = m.slots.size();
+        m.slots.push_back(n);
+        for (size_t i = 0; i < n; i++) {
+          uint32_t s = handle(get_slot(c, i));
+          m.slots.push_back(s);
+        }
+      } else if (cell.h == tTask) {
+        m.tasks.push_back(future_tasks[cell.t]);
+        cell.t = m.tasks.size() - 1;
+      } else if (cell.h < tVal) { // a pair, the other tags are copied as they are
+        cell.h = handle(cell.h);
+        cell.t = handle(cell.t);
+      }
+      m.cells[copied[c] - tUser] = cell;
+    }
+  }
+};
+
+size_t import_values(const Message& m) { // a list of the values of m, rebuilt in this heap
+  bool collecting = gc_on_alloc;
+  gc_on_alloc = false; // the new cells aren't rooted
+  vector<size_t> cells(m.cells.size());
+  auto value = [&](uint32_t v) { return v < tUser || is_imm(v) ? size_t(v) : cells[v - tUser]; };
+  for (size_t i = 0; i < cells.size(); i++) {
+    Var c = m.cells[i];
+    if (c.h == tTask) {
+      future_tasks.push_back(m.tasks[c.t]);
+      c.t = future_tasks.size() - 1;
+    }
+    cells[i] = c.h == tSymbol ? get_symbol(&m.names[c.t]) : c.h == tVector ? mk_vector(m.slots[c.t]) :
+      c.h < tVal ? mk_pair(0, 0) : mk_ref(c.h, c.t);
+  }
+  for (size_t i = 0; i < cells.size(); i++) {
+    Var c = m.cells[i];
+    if (c.h == tVector) {
+      for (size_t s = 0; s < m.slots[c.t]; s++)
+        set_slot(cells[i], s, value(m.slots[c.t + 1 + s]));
+    } else if (c.h < tVal) {
+      set_h(cells[i], value(c.h));
+      set_t(cells[i], value(c.t));
+    }
+  }
+  size_t r = 0;
+  for (size_t i = m.values.size(); i--;)
+    r = mk_pair(value(m.values[i]), r);
+  gc_on_alloc = collecting;
+  return r;
+}
+
+size_t call_pure(size_t fn, size_t params) { // fn called with the list params and a nil continuation, fn is rooted by the caller
+  Root p(params), call(mk_pair(mk_pair(tLit, fn), 0)), last;
+  last = call;
+  for (; p; p = t(p)) { // ((' . fn) (' . param)...)
+    set_t(last, mk_pair(mk_pair(tLit, h(p)), 0));
+    last = t(last);
+  }
+  return cont_eval(call, 0);
+}
+
+struct Task { // fn called once, or with each of params if map
+  std::shared_ptr<const Message> fn;
+  Message params, result;
+  bool map = false;
+  std::atomic<bool> done{false};
+};
+
+void run_task(Task& task) {
+  Root fn(h(import_values(*task.fn))), params(import_values(task.params)), r;
+  if (task.map) {
+    Root reversed;
+    for (; params; params = t(params)) {
+      size_t v = call_pure(fn, mk_pair(h(params), 0));
+      reversed = mk_pair(v, reversed);
+    }
+    for (; reversed; reversed = t(reversed))
+      r = mk_pair(h(reversed), r);
+  } else
+    r = call_pure(fn, params);
+  Exporter{task.result}.add(r);
+  task.done.store(true, std::memory_order_release);
+}
+
+const size_t kNotWorker = ~size_t(0);
+thread_local size_t worker_index = kNotWorker;
+
+class WorkPool { // worker threads with their own heaps, each with a deque of tasks
+  struct Deque {
+    std::mutex m;
+    std::deque<std::shared_ptr<Task>> tasks;
+  };
+  std::deque<Deque> deques;
+  std::mutex m;
+  std::condition_variable changed; // a task was pushed or done
+  size_t queued = 0;
+  bool stopping = false;
+  std::atomic<size_t> next{0}; // deque for the next task pushed by a thread that isn't a worker
+  vector<std::thread> threads;
+
+  std::shared_ptr<Task> take(size_t first) { // from the back of deque first, else stolen from the front of another
+    for (size_t i = 0; i < deques.size(); i++) {
+      Deque& d = deques[(first + i) % deques.size()];
+      std::shared_ptr<Task> task;
+      {
+        std::lock_guard<std::mutex> lock(d.m);
+        if (d.tasks.empty())
+          continue;
+        if (i) {
+          task = std::move(d.tasks.front());
+          d.tasks.pop_front();
+          steals++;
+        } else {
+          task = std::move(d.tasks.back());
+          d.tasks.pop_back();
+        }
+      }
+      std::lock_guard<std::mutex> lock(m);
+      queued--;
+      return task;
+    }
+    return nullptr;
+  }
+  void run(Task& task) {
+    run_task(task);
+    {
+      std::lock_guard<std::mutex> lock(m); // so that a waiter can't miss done
+    }
+    changed.notify_all();
+  }
+  void work(size_t id) {
+    worker_index = id;
+    reset_global_ctx();
+    for (;;) {
+      if (std::shared_ptr<Task> task = take(id)) {
+        run(*task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m);
+      changed.wait(lock, [&]{ return stopping || queued; });
+      if (stopping)
+        break;
+    }
+    release_thread();
+  }
+
+public:
+  std::atomic<size_t> steals{0};
+
+  explicit WorkPool(size_t count) : deques(count) {
+    for (size_t i = 0; i < count; i++)
+      threads.emplace_back([this, i]{ work(i); });
+  }
+  WorkPool(const WorkPool&) = delete;
+  ~WorkPool() { // the tasks still queued are dropped
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stopping = true;
+    }
+    changed.notify_all();
+    for (auto& t : threads)
+      t.join();
+  }
+  size_t size() const { return deques.size(); }
+  void push(std::shared_ptr<Task> task) { // to the deque of this worker, or in turn
+    Deque& d = deques[worker_index != kNotWorker ? worker_index : next++ % deques.size()];
+    {
+      std::lock_guard<std::mutex> lock(m); // counted before it can be taken, so take can't make queued wrap
+      queued++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(d.m);
+      d.tasks.push_back(std::move(task));
+    }
+    changed.notify_all();
+  }
+  void wait(Task& task) { // runs queued tasks meanwhile, so a worker can wait for the futures it made
+    while (!task.done.load(std::memory_order_acquire)) {
+      if (std::shared_ptr<Task> other = take(worker_index != kNotWorker ? worker_index : 0)) {
+        run(*other);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m);
+      changed.wait(lock, [&]{ return task.done.load(std::memory_order_acquire) || queued; });
+    }
+  }
+};
+
+size_t pool_threads = 0; // workers of work_pool, 0 for one per core
+WorkPool* work_pool = nullptr; // made by a future or pmap that finds it nil, set under work_pool_m
+std::mutex work_pool_m;
+
+WorkPool& workers() {
+  std::lock_guard<std::mutex> lock(work_pool_m);
+  if (!work_pool)
+    work_pool = new WorkPool(pool_threads ? pool_threads : std::max(1u, std::thread::hardware_concurrency()));
+  return *work_pool;
+}
+
+WorkPool* use_workers(WorkPool* pool) { // returns the one used before, which may be nil
+  std::lock_guard<std::mutex> lock(work_pool_m);
+  std::swap(pool, work_pool);
+  return pool;
+}
+
+size_t pmap(size_t fn, size_t list) { // fn and list are rooted by the caller
+  WorkPool& pool = workers();
+  auto code = std::make_shared<Message>();
+  Exporter{*code}.add(fn);
+  size_t count = 0;
+  for (size_t l = list; l; l = t(l))
+    count++;
+  size_t chunk = std::max(size_t(1), count / (pool.size() * 4)); // small enough to balance by stealing
+  vector<std::shared_ptr<Task>> tasks;
+  for (size_t l = list; l;) {
+    auto task = std::make_shared<Task>();
+    task->fn = code;
+    task->map = true;
+    Exporter items{task->params};
+    for (size_t i = 0; i < chunk && l; i++, l = t(l))
+      items.add(h(l));
+    pool.push(task);
+    tasks.push_back(std::move(task));
+  }
+  Root r; // the results of the chunks from the last one, each linked to the ones after it
+  for (size_t i = tasks.size(); i--;) {
+    pool.wait(*tasks[i]);
+    size_t results = h(import_values(tasks[i]->result)), last = results;
+    if (!results)
+      continue;
+    while (t(last))
+      last = t(last);
+    set_t(last, r);
+    r = results;
+  }
+  return r;
+}
+
+size_t start_future(size_t fn) { // fn is rooted by the caller
+  auto task = std::make_shared<Task>();
+  auto code = std::make_shared<Message>();
+  Exporter{*code}.add(fn);
+  task->fn = code;
+  workers().push(task);
+  future_tasks.push_back(std::move(task));
+  return mk_ref(tTask, future_tasks.size() - 1);
+}
+
+Task* future_task(size_t future) { // nil after telling so if it isn't a future
+  if (future && !is_imm(future) && vars[future].h == tTask)
+    return future_tasks[vars[future].t].get();
+  std::cerr << "touch of " << format(future) << ", which isn't a future" << std::endl;
+  return nullptr;
+}
+
+size_t future_value(Task& task) {
+  workers().wait(task);
+  return h(import_values(task.result));
+}
+
+// -- evaluation with continuation passing
+
+size_t eval_param(size_t n, size_t ctx) {
+  return !n || is_int(n) ? n :
+    vars[n].h == tLocal || vars[n].h == tCaptured ? lookup(n, ctx) :
+    vars[n].h == tSymbol ? n :
+    h(n) == tLit ? t(n) :
+    mk_closure(n, h(n), ctx);
+}
+
+size_t closure_body(size_t fn) { // the call in the lambda ((param_count frame_size captures...) fn params...)
+  return is_vector(fn) ? t(get_slot(fn, 0)) : 0;
+}
+
+size_t bind(size_t cont, size_t value) { // a frame for cont with value in its first param, nil in the rest
+  Root val(value);
+  size_t r = mk_vector(is_vector(cont) ? frame_size(h(get_slot(cont, 0))) : 2); // no continuation: the tNil step that follows returns val
+  uint32_t* s = new_slots(r);
+  s[0] = cont;
+  if (vector_size(r) > 1)
+    s[1] = val;
+  return r;
+}
+
+void jmp(Root& n, Root& ctx, size_t value, size_t at = 3) { // to the continuation in param at of n
+  Root val(value);
+  size_t param = n;
+  for (size_t i = 0; i < at; i++)
+    param = t(param);
+  if (in_frame(h(param))) { // no allocation, the value goes to a slot of this frame
+    if (h(h(param)))
+      set_slot(ctx, vars[h(h(param))].t, val);
+    n = t(h(param));
+    return;
+  }
+  Root cont(eval_param(h(param), ctx));
+  ctx = bind(cont, val);
+  n = closure_body(cont);
+}
+
+size_t cont_eval(size_t node, size_t context) {
+  nursery_enabled = gc_on_alloc = true;
+  Root n(node), ctx(context);
+  Scheduler threads;
+  for (;;)
+  {
+    gc_safepoint();
+    eval_steps++;
+    if (threads.ready && ++threads.steps >= time_slice && threads.others_ready())
+      threads.switch_thread(n, ctx); // preempted
+    if (trace_eval) {
+      for (size_t slot = 1; is_vector(ctx) && slot < vector_size(ctx); slot++)
+        std::cout << "  $" << slot << " = " << format(get_slot(ctx, slot)) << "\n";
+      std::cout << "f: " << format(n) << std::endl;
+    }
+    if (h(n) >= qAdd && h(n) <= qEq) {
+      size_t value;
+      if (quick_op(n, ctx, value)) {
+        jmp(n, ctx, value);
+        continue;
+      }
+      despecialize(n);
+    }
+    size_t known = h(n) == qCall ? known_callee(n, ctx) : kUnknown;
+    if (h(n) == qCall && known == kUnknown)
+      despecialize(n);
+    Root fn(known != kUnknown ? known : eval_param(h(n), ctx));
+    if (fn >= tAdd && fn <= tEq)
+      quicken_op(n, ctx); // runs quick from the next time
+    switch (fn) // if (builtin_symbol params cont)
+    {
+      case tNil:
+        if (threads.current) { // a spawned thread ends
+          if (!threads.resume(n, ctx))
+            return deadlock();
+          continue;
+        }
+        return t(n) ? eval_param(h(t(n)), ctx) : last_param(ctx);
+      case tIf: {
+        size_t at = eval_param(h(t(n)), ctx) ? 2 : 3, branch = h(t(t(at == 2 ? n : t(n))));
+        if (in_frame(branch)) {
+          jmp(n, ctx, 0, at);
+          continue;
+        }
+        fn = eval_param(branch, ctx);
+        ctx = bind(fn, 0);
+        n = closure_body(fn);
+        if (!n) return fn;
+        continue;
+      }
+      case tAdd: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) + get_int(eval_param(h(t(t(n))), ctx)))); continue;
+      case tSub: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) - get_int(eval_param(h(t(t(n))), ctx)))); continue;
+      case tMul: jmp(n, ctx, mk_int(get_int(eval_param(h(t(n)), ctx)) * get_int(eval_param(h(t(t(n))), ctx)))); continue;
+      case tLt: jmp(n, ctx, get_int(eval_param(h(t(n)), ctx)) < get_int(eval_param(h(t(t(n))), ctx)) ? tLt : tNil); continue;
+      case tEq: jmp(n, ctx, get_int(eval_param(h(t(n)), ctx)) == get_int(eval_param(h(t(t(n))), ctx)) ? tEq : tNil); continue;
+      case tCon: {
+        Root head(eval_param(h(t(n)), ctx));
+        jmp(n, ctx, mk_pair(head, eval_param(h(t(t(n))), ctx)));
+        continue;
+      }
+      case tHead: jmp(n, ctx, h(eval_param(h(t(n)), ctx)), 2); continue;
+      case tTail: jmp(n, ctx, t(eval_param(h(t(n)), ctx)), 2); continue;
+      case tSpawn: { // (spawn fn k)
+        Root entry(bind(fn = eval_param(h(t(n)), ctx), 0));
+        jmp(n, ctx, mk_int(threads.spawn(closure_body(fn), entry)), 2);
+        continue;
+      }
+      case tYield:
+        jmp(n, ctx, 0, 1);
+        if (threads.others_ready())
+          threads.switch_thread(n, ctx);
+        continue;
+      case tChan: jmp(n, ctx, mk_channel(), 1); continue;
+      case tSend: { // (send channel value k)
+        Root channel(eval_param(h(t(n)), ctx)), value(eval_param(h(t(t(n))), ctx));
+        Root receiver(dequeue(t(channel)));
+        if (receiver) { // waits at (recv channel k), so it goes on at k with value
+          Root rn(h(t(receiver))), rctx(t(t(receiver)));
+          jmp(rn, rctx, value, 2);
+          threads.wake(get_int(h(receiver)), rn, rctx);
+        } else
+          enqueue(h(channel), value);
+        jmp(n, ctx, 0, 3);
+        continue;
+      }
+      case tRecv: { // (recv channel k)
+        Root channel(eval_param(h(t(n)), ctx));
+        if (h(h(channel))) {
+          jmp(n, ctx, dequeue(h(channel)), 2);
+          continue;
+        }
+        enqueue(t(channel), threads.suspend(n, ctx)); // send moves it on to k
+        if (!threads.resume(n, ctx))
+          return deadlock();
+        continue;
+      }
+      case tFuture: jmp(n, ctx, start_future(fn = eval_param(h(t(n)), ctx)), 2); continue;
+      case tTouch: { // (touch future k)
+        Task* task = future_task(eval_param(h(t(n)), ctx));
+        if (task && !task->done && threads.others_ready()) { // runs this node again after the ready green threads
+          threads.switch_thread(n, ctx);
+          continue;
+        }
+        jmp(n, ctx, task ? future_value(*task) : 0, 2);
+        continue;
+      }
+      case tPmap: { // (pmap fn list k)
+        fn = eval_param(h(t(n)), ctx);
+        Root list(eval_param(h(t(t(n))), ctx));
+        jmp(n, ctx, pmap(fn, list), 3);
+        continue;
+      }
+    }
+    if (!is_vector(fn))
+      return quotes_params(fn) ? unsupported(fn) : fn;
+    quicken_call(n, fn);
+    size_t info = h(get_slot(fn, 0)), params = param_count(info); // (fn params), fn is a closure
+    Root frame(mk_vector(frame_size(info)));
+    set_slot(frame, 0, fn);
+    for (size_t actual = h(n) == qCall ? t(t(n)) : t(n), i = 1; i <= params; actual = t(actual), i++)
+      set_slot(frame, i, actual ? eval_param(h(actual), ctx) : 0); // missing ones are nil, so slots match resolve
+    ctx = frame;
+    n = closure_body(fn);
+  }
+}
+
+int cont_compile_eval(const char* s) {
+  size_t ctx = reset_global_ctx();
+  size_t fn = parse(s);
+  return s == &error_marker || *s ? printf("error at %s", s), -1 : get_int(cont_eval(resolve(fn, true), ctx));
+}
+
+// -- classic evaluation
+
+size_t eval(size_t node, size_t context);
+
+void enter(Root& n, Root& ctx, size_t closure, size_t params) { // runs closure with params evaluated in ctx
+  Root fn(closure), actual(params);
+  size_t info = h(t(get_slot(fn, 0))), count = param_count(info); // closure of (lambda info body)
+  Root frame(mk_vector(frame_size(info)));
+  set_slot(frame, 0, fn);
+  for (size_t i = 1; i <= count; i++, actual = t(actual)) {
+    size_t p = h(actual), val = !actual ? 0 : is_simple(p) ? simple_value(p, ctx) : eval(p, ctx); // missing ones are nil
+    set_slot(frame, i, val);
+  }
+  ctx = frame;
+  n = h(t(t(get_slot(fn, 0))));
+}
+
+size_t eval(size_t node, size_t context) {
+  nursery_enabled = gc_on_alloc = true;
+  Root n(node), ctx(context);
+  for (;;) {
+    gc_safepoint();
+    if (trace_eval) {
+      for (size_t slot = 1; is_vector(ctx) && slot < vector_size(ctx); slot++)
+        std::cout << "  $" << slot << " = " << format(get_slot(ctx, slot)) << "\n";
+      std::cout << "f: " << format(n) << std::endl;
+    }
+    if (!n || is_int(n)) return n;
+    if (vars[n].h == tLocal || vars[n].h == tCaptured) return lookup(n, ctx);
+    if (vars[n].h == tGlobal || vars[n].h == tGlobalSlot) return get_global(global_ref_slot(n));
+    if (vars[n].h == tSymbol) return n;
+    if (h(n) >= qAdd && h(n) <= qEq) {
+      size_t value;
+      if (quick_op(n, ctx, value))
+        return value;
+      despecialize(n);
+    }
+    if (h(n) == qCall) {
+      size_t fn = known_callee(n, ctx);
+      if (fn != kUnknown) {
+        enter(n, ctx, fn, t(t(n)));
+        continue;
+      }
+      despecialize(n);
+    }
+    Root fn(eval(h(n), ctx));
+    switch (fn) {
+    case tLit: return t(n);
+    case tIf: n = h(t(t(eval(h(t(n)), ctx) ? n : t(n)))); continue;
+    case tAdd: case tSub: case tMul: case tLt: case tEq: {
+      quicken_op(n, ctx); // runs quick from the next time
+      int a = get_int(eval(h(t(n)), ctx)); // sequenced: the next eval may move what n and ctx refer to
+      int b = get_int(eval(h(t(t(n))), ctx));
+      switch (fn) {
+      case tAdd: return mk_int(a + b);
+      case tSub: return mk_int(a - b);
+      case tMul: return mk_int(a * b);
+      case tLt: return a < b ? tLt : 0; // true is the builtin: n may be quickened
+      default: return a == b ? tEq : 0;
+      }
+    }
+    case tCon: {
+      Root head(eval(h(t(n)), ctx));
+      size_t tail = eval(h(t(t(n))), ctx);
+      return mk_pair(head, tail);
+    }
+    case tHead: return h(eval(h(t(n)), ctx));
+    case tTail: return t(eval(h(t(n)), ctx));
+    case tLambda: return mk_closure(n, h(t(n)), ctx);
+    case tLet: case tLetRec: { // (let $slot initializer body), a letrec lambda refers to itself by its slot 0
+      size_t slot = vars[h(t(n))].t;
+      bool patch = t(t(t(t(n)))); // else the initializer's closures don't capture the slot
+      if (patch)
+        set_slot(ctx, slot, mk_pair(0, 0)); // the hole they capture
+      size_t val = eval(h(t(t(n))), ctx);
+      if (patch)
+        patch_letrec(val, get_slot(ctx, slot));
+      set_slot(ctx, slot, val);
+      n = h(t(t(t(n))));
+      continue;
+    }
+    case tDefine: { // (define global_ref initializer body)
+      size_t val = eval(h(t(t(n))), ctx);
+      set_global(global_ref_slot(h(t(n))), val);
+      n = h(t(t(t(n))));
+      continue;
+    }
+    }
+    if (!is_vector(fn))
+      return cont_eval_only(fn) ? unsupported(fn) : 0;
+    quicken_call(n, fn);
+    enter(n, ctx, fn, h(n) == qCall ? t(t(n)) : t(n));
+  }
+}
+
+int compile_eval(const char* s) {
+  size_t ctx = reset_global_ctx();
+  size_t fn = parse_program(s);
+  return s == &error_marker || *s ? printf("error at %s", s), -1 : get_int(eval(resolve(fn, false), ctx));
+}
+
+void cont_eval_test() {
+  assert(2 == cont_compile_eval("(- 3 1)"));
+  assert(4 == cont_compile_eval("(- 3 1 ((x) + x x))")); // x=3-1; x+x
+  assert(5 == cont_compile_eval("(((a b) + a b) 2 3)")); // ((lambda (a b) (+ a b)) 2 3)
+  assert(5 == cont_compile_eval("(< 3 1 ((a) ? a 2 5))")); // if 3<1 :2 :5
+  assert(7 == cont_compile_eval("(((add) add 3 ((f) f 4 ((r) r))) ((a k) k ((b k2) + a b k2)))"));
+  assert(4 == cont_compile_eval(R"-(
+    (((len) len (' 1 2 3 4) nil)
+      ((list r)
+        ((lnrec) lnrec 0  list lnrec r)
+        ((c l f r)
+          ? l
+            (() tail l ((tl) + 1 c ((inc) f inc tl f r)))
+            (() r c))
+      )
+    ))-"));
+}
+
+void eval_test() {
+  assert(2 == compile_eval("(- 3 1)"));
+  assert(4 == compile_eval("(let x (- 3 1) (+ x x))"));
+  assert(5 == compile_eval("((lambda (a b) (+ a b)) 2 3)"));
+  assert(5 == compile_eval("(? (< 3 1) 2 5)"));
+  assert(7 == compile_eval("(let add (lambda (a) (lambda (b) (+ a b))) ((add 3) 4))"));
+  assert(5 == compile_eval("(let f lambda (let g f ((g (x) x) 5)))")); // special forms through aliases
+  assert(1 == compile_eval("(let l let (l x 1 x))"));
+  assert(7 == compile_eval("(letrec f (let k 7 (lambda (n) (? (< 0 n) (f (- n 1)) k))) (f 3))")); // patched, see patch_letrec
+  assert(0 == compile_eval("(letrec l (. 1 l) (head (tail l)))")); // nil until the initializer is done
+  assert(4 == compile_eval(R"-(
+    (letrec len
+      (lambda (l)
+        (? l
+          (+ 1 (len (tail l)))
+          0
+        )
+      )
+      (len (' 1 2 3 4))
+    ))-"));
+  assert(4 == compile_eval(R"-(
+    (let len
+      (lambda (list)
+        (letrec len_r
+          (lambda (c l)
+            (? l
+              (len_r (+ 1 c) (tail l))
+              c
+            )
+          )
+          (len_r 0 list)
+        )
+      )
+      (len (' 1 2 3 4))
+    ))-"));
+  reset_global_ctx();
+  const char* pos;
+  size_t program = resolve(parse(pos = "(let big (' 1 2 3 4 5 6 7 8 9) (let small 5 (lambda (x) (+ x small))))"), false);
+  size_t big = t(h(t(t(h(t(t(h(program))))))));
+  Root fn(eval(program, 0));
+  assert(format(fn) == "[(lambda (1 2 $2 .) (+ $1 ^1 .) .) 5]");
+  gc_minor();
+  gc_collect(shadow_stack);
+  gc_finish_sweep();
+  assert(vars[big].h == tFree); // a closure keeps alive only what it captures
+  assert(1 == compile_eval(R"-(
+    (define even (lambda (n) (? (= n 0) 1 (odd (- n 1)))))
+    (define odd (lambda (n) (? (= n 0) 0 (even (- n 1)))))
+    (even 10))-"));
+  assert(12 == compile_eval("(define x 5) (define f (lambda (y) (+ x y))) (define x 7) (f 5)")); // globals aren't captured
+  reset_global_ctx();
+  program = resolve(parse_program(pos = "(define one 1) (+ one one)"), false);
+  size_t ref = h(t(h(t(t(t(program))))));
+  assert(get_int(eval(program, 0)) == 2);
+  assert(vars[ref].h == tGlobalSlot && format(program) == "(define @0 1 (+ @0 @0 .) .)");
+  for (const char* p : {"(let add (lambda (a) (lambda (b) (+ a b))) ((add 3) 4))", "(? (< (* 2 3) 7) (+ 1 2) 4)",
+      "(letrec len (lambda (l) (? l (+ 1 (len (tail l))) 0)) (len (' 1 2 3 4)))", "(let x 5 (let f (lambda (y) (+ x y)) (f 1)))"}) {
+    int expected = compile_eval(p);
+    assert(expected > 0);
+    reset_global_ctx();
+    assert(get_int(eval(resolve(optimize(parse_program(pos = p), false), false), 0)) == expected);
+  }
+  for (const char* p : {"(((add) add 3 ((f) f 4 ((r) r))) ((a k) k ((b k2) + a b k2)))", "(= 2 2 ((c) ? c (() * 3 3) (() 0)))",
+      "(((x) < x 3 ((c) ? c (() + x 1 ((y) y)) (() nil))) 2)"}) {
+    int expected = cont_compile_eval(p);
+    assert(expected > 0);
+    reset_global_ctx();
+    assert(get_int(cont_eval(resolve(optimize(parse(pos = p), true), true), 0)) == expected);
+  }
+}
+
+void quickening_test() {
+  reset_global_ctx();
+  const char* pos;
+  size_t program = resolve(parse(pos = "(let f (lambda (x) (+ x 1)) (+ (f 2) (f 3)))"), false);
+  Root r(program);
+  assert(get_int(eval(program, 0)) == 7);
+  assert(format(r) == "((lambda (0 2 .) (let $1 hb:(lambda (1 2 .) (quick + $1 1 .) .) (+ (quick call ($1 #hb) 2 .) "
+    "(quick call ($1 #hb) 3 .) .) .) .) .)");
+  r = 0;
+  reset_global_ctx(); // shared nodes are labelled by their handles
+  program = resolve(parse(pos = "(((f) f 2 ((a) f 3 ((b) + a b))) ((x k) + x 1 k))"), true);
+  r = program;
+  assert(get_int(cont_eval(program, 0)) == 7);
+  assert(format(r) == "(((1 2 .) quick call ($1 cc:((2 3 .) quick + $1 1 $2 .)) 2 ((1 2 $1 .) quick call (^1 #cc) 3 "
+    "((1 2 $1 .) quick + ^1 $1 .) .) .) #cc .)");
+  r = 0;
+  // true of a quickened comparison is the builtin, not the node it was quickened in
+  reset_global_ctx();
+  assert(format(eval(resolve(parse(pos = "(let f (lambda (x) (< x 2)) (. (f 1) (f 1)))"), false), 0)) == "(< <)");
+  reset_global_ctx();
+  assert(format(cont_eval(resolve(parse(pos = "(((f) f 1 ((a) f 1 ((b) . a b))) ((x k) = x 1 k))"), true), 0)) == "(= =)");
+  // guards: another lambda at a quickened call, and an int that isn't immediate or nil at a quickened +
+  assert(7 == compile_eval("(let g (lambda (f) (f 1)) (+ (g (lambda (x) (+ x 1))) (g (lambda (x) (* x 5)))))"));
+  assert(999999999 == compile_eval("(let f (lambda (x) (+ x 1)) (- (f 1000000000) (f 1)))"));
+  assert(3 == compile_eval("(let f (lambda (x) (+ x 1)) (+ (f 1) (f nil)))"));
+  assert(7 == cont_compile_eval("(((g) g ((x k) + x 1 k) ((a) g ((x k) * x 5 k) ((b) + a b))) ((f k) f 1 k))"));
+  assert(999999999 == cont_compile_eval("(((f) f 1000000000 ((a) f 1 ((b) - a b))) ((x k) + x 1 k))"));
+}
+
+void quickening_benchmark() {
+  const char* const programs[][2] = {
+    {"c", R"-(
+      (letrec range (lambda (n l) (? (= n 0) l (range (- n 1) (. n l))))
+        (let len
+          (lambda (list) (letrec len_r (lambda (c l) (? l (len_r (+ 1 c) (tail l)) c)) (len_r 0 list)))
+          (len (range 1000000 nil)))))-"},
+    {"p", R"-(
+      (((range len) range 1000000 nil range ((l) len l nil))
+        ((n acc self k) = n 0 ((z) ? z (() k acc) (() . n acc ((a) - n 1 ((n1) self n1 a self k)))))
+        ((list r)
+          ((lnrec) lnrec 0 list lnrec r)
+          ((c l f r) ? l (() tail l ((tl) + 1 c ((inc) f inc tl f r))) (() r c)))))-"},
+  };
+  for (auto& p : programs) {
+    bool cont_passing = *p[0] == 'p';
+    for (bool quick : {false, true}) {
+      quickening = quick;
+      int r = 0;
+      double ms = time_ms([&]{ r = (cont_passing ? cont_compile_eval : compile_eval)(p[1]); });
+      assert(r == 1000000);
+      std::cout << "list length 1000000, " << (cont_passing ? "cont_eval" : "eval") <<
+        (quick ? " quickened: " : ": ") << ms << "ms" << std::endl;
+    }
+  }
+  quickening = true;
+  reset_allocator();
+}
+
+// -- conversion to continuation passing
+// classic programs rewritten for cont_eval, which runs them in constant C stack depth.
+// A converted lambda takes its continuation as the first param, so missing params are still nil,
+// and one defined by letrec also takes itself, as continuation passing lambdas can't refer to themselves.
+
+bool converting = false; // classic syntax run as continuation passing
+thread_local size_t cps_names = 0;
+
+size_t fresh_name(char kind) { return get_symbol(string("%") + kind + std::to_string(cps_names++)); }
+
+struct Cont { // what a converted expression does with its value
+  size_t k; // calls this param with it, if rest is empty
+  std::function<size_t(size_t)> rest; // or builds the call that uses it
+};
+
+size_t list(std::initializer_list<size_t> items) {
+  size_t r = 0;
+  for (auto i = items.end(); i != items.begin();)
+    r = mk_pair(*--i, r);
+  return r;
+}
+
+size_t pass(const Cont& c, size_t value) { return c.rest ? c.rest(value) : list({c.k, value}); }
+
+size_t cont_param(const Cont& c) { // the continuation as the param of a call
+  if (!c.rest)
+    return c.k;
+  size_t v = fresh_name('v');
+  return mk_pair(list({v}), c.rest(v));
+}
+
+bool carries_code(const Cont& c) { return c.rest || (c.k && vars[c.k].h != tSymbol); }
+
+bool has_symbol(size_t l, size_t s) {
+  for (; l; l = t(l))
+    if (h(l) == s)
+      return true;
+  return false;
+}
+
+size_t rename(size_t n, size_t from, size_t to) { // classic expression n, with the free uses of from renamed to
+  if (!n || is_int(n))
+    return n;
+  if (vars[n].h == tSymbol)
+    return n == from ? to : n;
+  if (h(n) == tLit || (h(n) == tLambda && has_symbol(h(t(n)), from)) || (h(n) == tLetRec && h(t(n)) == from))
+    return n;
+  if (h(n) == tLet && h(t(n)) == from)
+    return list({tLet, from, rename(h(t(t(n))), from, to), h(t(t(t(n))))});
+  return map_list(n, [&](size_t e) { return rename(e, from, to); });
+}
+
+bool in_lambda(size_t n, size_t s, bool inside = false) { // if a lambda in classic expression n uses s free
+  if (!n || is_int(n))
+    return false;
+  if (vars[n].h == tSymbol)
+    return inside && n == s;
+  if (h(n) == tLit || (h(n) == tLambda && has_symbol(h(t(n)), s)) || (h(n) == tLetRec && h(t(n)) == s))
+    return false;
+  if (h(n) == tLet && h(t(n)) == s)
+    return in_lambda(h(t(t(n))), s, inside);
+  inside = inside || h(n) == tLambda;
+  for (; n; n = t(n))
+    if (in_lambda(h(n), s, inside))
+      return true;
+  return false;
+}
+
+size_t builtin_lambda(size_t fn) { // a builtin used as a value, taking its continuation first like converted lambdas
+  size_t k = fresh_name('k'), a = fresh_name('v'), b = fresh_name('v'), c = fresh_name('v');
+  if (fn == tIf)
+    return mk_pair(list({k, c, a, b}), list({tIf, c, list({0, k, a}), list({0, k, b})}));
+  if (fn == tHead || fn == tTail)
+    return mk_pair(list({k, a}), list({fn, a, k}));
+  return mk_pair(list({k, a, b}), list({fn, a, b, k}));
+}
+
+size_t self_params(size_t s, vector<std::pair<size_t, size_t>>& env) { // of the letrec lambda s names, else kUnknown
+  for (size_t i = env.size(); i--;)
+    if (env[i].first == s)
+      return env[i].second;
+  return kUnknown;
+}
+
+size_t to_cps(size_t n, const Cont& c, vector<std::pair<size_t, size_t>>& env);
+
+size_t to_cps_lambda(size_t params, size_t body, size_t self, vector<std::pair<size_t, size_t>>& env) {
+  size_t k = fresh_name('k'), size = env.size();
+  for (size_t p = params; p; p = t(p))
+    env.push_back({h(p), kUnknown});
+  size_t call = to_cps(body, Cont{k, nullptr}, env);
+  env.resize(size);
+  return mk_pair(mk_pair(k, self ? mk_pair(self, params) : params), call);
+}
+
+size_t to_cps_args(size_t l, vector<size_t>& values, const std::function<size_t()>& done,
+    vector<std::pair<size_t, size_t>>& env) { // converts the expressions in l in order, then builds the call with done
+  if (!l)
+    return done();
+  return to_cps(h(l), Cont{0, [&](size_t v) {
+    values.push_back(v);
+    return to_cps_args(t(l), values, done, env);
+  }}, env);
+}
+
+size_t to_cps(size_t n, const Cont& c, vector<std::pair<size_t, size_t>>& env) {
+  if (!n || is_int(n))
+    return pass(c, n);
+  if (vars[n].h == tSymbol) {
+    size_t self = self_params(n, env);
+    if (self != kUnknown) { // ((k params...) n k n params...)
+      size_t k = fresh_name('k'), args = map_list(self, [](size_t p) { return p; }); // resolve replaces the args
+      return pass(c, mk_pair(mk_pair(k, self), mk_pair(n, mk_pair(k, mk_pair(n, args)))));
+    }
+    return pass(c, is_builtin(n, env) && n >= tIf && n <= tTail ? builtin_lambda(n) : n);
+  }
+  size_t fn = h(n), args = t(n), size = env.size();
+  vector<size_t> values;
+  if (is_builtin(fn, env)) {
+    switch (fn) {
+    case tLit: return pass(c, n);
+    case tLambda: return pass(c, to_cps_lambda(h(args), h(t(args)), 0, env));
+    case tIf: { // (? condition then else)
+      if (carries_code(c)) { // the branches share a continuation, not a copy of it:
+        // (((j) ? v (() ...) (() ...)) ((v) rest...))
+        size_t j = fresh_name('k');
+        size_t call = to_cps(n, Cont{j, nullptr}, env);
+        return list({mk_pair(list({j}), call), cont_param(c)});
+      }
+      return to_cps(h(args), Cont{0, [&](size_t v) {
+        size_t then = to_cps(h(t(args)), c, env);
+        return list({tIf, v, mk_pair(0, then), mk_pair(0, to_cps(h(t(t(args))), c, env))});
+      }}, env);
+    }
+    case tLet: case tLetRec: { // (let name initializer body), the initializer continues into ((name) body...)
+      size_t name = h(args), init = h(t(args)), body = h(t(t(args))), self = 0;
+      if (carries_code(c)) { // which would end up in the scope of name, so that gets a name of its own
+        size_t to = fresh_name('x');
+        if (fn == tLetRec)
+          init = rename(init, name, to);
+        body = rename(body, name, to);
+        name = to;
+      }
+      if (fn == tLetRec && h(init) == tLambda && is_builtin(tLambda, env)) {
+        self = name;
+        env.push_back({self, h(t(init))});
+      } else {
+        if (fn == tLetRec) { // the closures of init would need the value patched in, as resolve does
+          if (in_lambda(init, name)) {
+            std::cerr << "letrec " << symbol_name(name) << " can't be converted to continuation passing, "
+              "as a lambda in its initializer refers to it" << std::endl;
+            return 0;
+          }
+          init = rename(init, name, 0); // nil until the initializer is done, as in eval
+        }
+        env.push_back({name, kUnknown});
+      }
+      size_t k = mk_pair(list({name}), to_cps(body, c, env));
+      if (self) { // ((self) body...) called with ((k self params...) ...), where self calls itself by passing itself
+        size_t lambda = to_cps_lambda(h(t(init)), h(t(t(init))), self, env);
+        env.resize(size);
+        return list({k, lambda});
+      }
+      env.resize(size);
+      return to_cps(init, Cont{k, nullptr}, env);
+    }
+    case tDefine:
+      std::cerr << "define can't be converted to continuation passing" << std::endl;
+      return 0;
+    case tAdd: case tSub: case tMul: case tLt: case tEq: case tCon: case tHead: case tTail:
+    case tSpawn: case tYield: case tChan: case tSend: case tRecv: case tFuture: case tTouch: // with their params as given
+      return to_cps_args(fn >= tSpawn ? args : fn < tHead ? list({h(args), h(t(args))}) : list({h(args)}), values, [&]() {
+        size_t r = list({cont_param(c)});
+        for (size_t i = values.size(); i--;)
+          r = mk_pair(values[i], r);
+        return mk_pair(fn, r);
+      }, env);
+    case tPmap: // (pmap fn list), pmap passes the continuation last, so fn is called through ((v k) fn k v)
+      return to_cps_args(list({h(args), h(t(args))}), values, [&]() {
+        size_t k = fresh_name('k'), v = fresh_name('v');
+        return list({fn, mk_pair(list({v, k}), list({values[0], k, v})), values[1], cont_param(c)});
+      }, env);
+    }
+  }
+  size_t self = self_params(fn, env);
+  return to_cps_args(self != kUnknown ? args : n, values, [&]() { // (fn k params...), or (fn k fn params...)
+    size_t r = 0, first = self != kUnknown ? 0 : 1;
+    for (size_t i = values.size(); i > first; i--)
+      r = mk_pair(values[i - 1], r);
+    if (self != kUnknown)
+      return mk_pair(fn, mk_pair(cont_param(c), mk_pair(fn, r)));
+    return mk_pair(values[0], mk_pair(cont_param(c), r));
+  }, env);
+}
+
+size_t to_continuation_passing(size_t program) { // classic syntax, before resolve
+  vector<std::pair<size_t, size_t>> env;
+  cps_names = 0;
+  unalias(program, env);
+  return to_cps(program, Cont{0, nullptr}, env);
+}
+
+int converted_compile_eval(const char* s) {
+  size_t ctx = reset_global_ctx();
+  size_t fn = parse_program(s);
+  return s == &error_marker || *s ? printf("error at %s", s), -1 :
+    get_int(cont_eval(resolve(to_continuation_passing(fn), true), ctx));
+}
+
+void cps_conversion_test() {
+  reset_global_ctx();
+  const char* pos;
+  assert(format(to_continuation_passing(parse_program(pos = "(+ 1 (* 2 3))"))) == "(* 2 3 ((%v0 .) + 1 %v0 . .) .)");
+  assert(format(to_continuation_passing(parse_program(pos = "(let f (lambda (x) (f x)) f)"))) ==
+    "(((f .) . f .) ((%k0 x .) f %k0 x .) .)");
+  assert(format(to_continuation_passing(parse_program(pos = "(letrec f (lambda (x) (f x)) (f 1))"))) ==
+    "(((f .) f . f 1 .) ((%k0 f x .) f %k0 f x .) .)");
+  const char* const programs[] = {
+    "(- 3 1)", "(let x (- 3 1) (+ x x))", "((lambda (a b) (+ a b)) 2 3)", "(? (< 3 1) 2 5)", "(+ 1 (? (< 3 1) 2 5))",
+    "(let x (? 3 2 5) (+ x 1))", "(let f (lambda (a) 5) (f (let f (lambda (a) 7) (f 1))))", "(let x 4 (+ x (let x 1 x)))",
+    "(let add (lambda (a) (lambda (b) (+ a b))) ((add 3) 4))", "(let f + (+ 1 (f 1 1)))", "((lambda (a b) (? b 1 a)) 7)",
+    "(letrec len (lambda (l) (? l (+ 1 (len (tail l))) 0)) (len (' 1 2 3 4)))",
+    "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 10))",
+    "(letrec f (lambda (n) (? (= n 0) 0 (let g f (g (- n 1))))) (+ 1 (f 5)))",
+    "(letrec g (lambda (f a) (f a)) (letrec f (lambda (n) (+ n 1)) (g f 5)))", // f as a value, not called
+    "(let f lambda (let g f ((g (x) x) 5)))", "(let f ? (f 1 2 3))",
+    "(letrec l (. 1 l) (head (tail l)))", "(letrec x (let l (' 1 2) (? x 0 l)) (head (tail x)))", // nil in its initializer
+  };
+  for (const char* p : programs) {
+    int expected = compile_eval(p);
+    assert(converted_compile_eval(p) == expected);
+  }
+  assert(100000 == converted_compile_eval(R"-(
+    (letrec range (lambda (n) (? (= n 0) nil (. n (range (- n 1)))))
+      (letrec len (lambda (l) (? l (+ 1 (len (tail l))) 0))
+        (len (range 100000)))))-")); // non tail recursion, with continuations in the heap
+}
+
+void conversion_benchmark() {
+  const char* program = "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 22))";
+  int classic = 0, converted = 0;
+  double classic_ms = time_ms([&]{ classic = compile_eval(program); });
+  double converted_ms = time_ms([&]{ converted = converted_compile_eval(program); });
+  assert(classic == 17711 && converted == classic);
+  std::cout << "fib 22: eval " << classic_ms << "ms, converted to cont_eval " << converted_ms << "ms" << std::endl;
+  reset_allocator();
+}
+
+void green_threads_test() {
+  assert(3 == cont_compile_eval("(chan ((c) spawn (() send c 1 (() send c 2 ())) ((id) recv c ((a) recv c ((b) + a b ())))))"));
+  assert(1 == cont_compile_eval("(spawn (() yield ()) ((id) yield ((x) id)))"));
+  assert(6 == converted_compile_eval("(let c (chan) (let t (spawn (lambda () (send c 5))) (+ (recv c) 1)))"));
+  assert(50005000 == converted_compile_eval(R"-(
+    (letrec spawn_all (lambda (c n) (? (= n 0) 0 (let t (spawn (lambda () (send c n))) (spawn_all c (- n 1)))))
+      (letrec sum (lambda (c n) (? (= n 0) 0 (+ (recv c) (sum c (- n 1)))))
+        (let c (chan) (let t (spawn_all c 10000) (sum c 10000))))))-")); // 10000 threads waiting on one channel
+  size_t slice = time_slice, switches = context_switches;
+  time_slice = 100;
+  assert(0 == converted_compile_eval(R"-(
+    (letrec count (lambda (n) (? (= n 0) 0 (count (- n 1))))
+      (let c (chan) (let t (spawn (lambda () (send c (count 5000)))) (+ (count 5000) (recv c))))))-"));
+  assert(context_switches - switches > 100); // neither yields, so they are preempted
+  time_slice = slice;
+}
+
+void green_threads_benchmark() {
+  const char* program = R"-(
+    (letrec loop (lambda (i) (? (= i 0) 0 (let y (yield) (loop (- i 1)))))
+      (letrec spawn_all (lambda (c n) (? (= n 0) 0 (let t (spawn (lambda () (let d (loop 10) (send c n)))) (spawn_all c (- n 1)))))
+        (letrec sum (lambda (c n) (? (= n 0) 0 (+ (recv c) (sum c (- n 1)))))
+          (let c (chan) (let t (spawn_all c 10000) (sum c 10000)))))))-";
+  size_t switches = context_switches;
+  int sum = 0;
+  double ms = time_ms([&]{ sum = converted_compile_eval(program); });
+  assert(sum == 50005000);
+  switches = context_switches - switches;
+  std::cout << "10000 green threads yielding 10 times: " << ms << "ms, " << switches << " context switches, " <<
+    int(switches / ms) << "K/s" << std::endl;
+  reset_allocator();
+}
+
+void futures_test() {
+  reset_global_ctx();
+  Root cycle(mk_pair(mk_int(1), 0)), copy;
+  set_t(cycle, mk_pair(mk_int(2000000000), mk_pair(get_symbol("a"), cycle))); // a boxed int, a symbol and a cycle
+  Message m;
+  Exporter{m}.add(cycle);
+  copy = h(import_values(m));
+  assert(copy != cycle && t(t(t(copy))) == copy && h(t(t(copy))) == get_symbol("a"));
+  assert(h(t(copy)) != h(t(cycle)) && get_int(h(t(copy))) == 2000000000);
+  assert(43 == cont_compile_eval("(future ((k) * 6 7 k) ((f) touch f ((x) + x 1 ())))"));
+  assert(43 == converted_compile_eval("(let f (future (lambda () (* 6 7))) (+ (touch f) 1))"));
+  assert(6 == converted_compile_eval("(let f (future (lambda () (let g (future (lambda () 5)) (+ 1 (touch g))))) (touch f))"));
+  assert(5 == converted_compile_eval("(let f (future (lambda () (future (lambda () 5)))) (touch (touch f)))")); // escapes its heap
+  assert(7 == converted_compile_eval("(let f (future (lambda () 3)) (let g (future (lambda () 4)) (+ (touch (head (pmap (lambda (x) g) (. 1 nil)))) (touch f))))"));
+  const char* sum = "(letrec sum (lambda (l) (? l (+ (head l) (sum (tail l))) 0)) ";
+  const char* range = "(letrec range (lambda (n) (? (= n 0) nil (. n (range (- n 1))))) ";
+  assert(333833500 == converted_compile_eval((string(sum) + range + "(sum (pmap (lambda (x) (* x x)) (range 1000)))))").c_str()));
+  assert(15 == converted_compile_eval((string(sum) + "(let y 2 (sum (pmap (lambda (x) (head (tail x))) "
+    "(' (0 1) (0 2) (0 3) (0 4) (0 5))))))").c_str())); // items are lists, fn captures y
+  assert(0 == converted_compile_eval("(pmap (lambda (x) x) nil)"));
+  WorkPool* saved = use_workers(nullptr);
+  {
+    WorkPool pool(2);
+    use_workers(&pool);
+    assert(42 == converted_compile_eval("(touch (future (lambda () 42)))"));
+    use_workers(nullptr);
+  }
+  assert(42 == converted_compile_eval("(touch (future (lambda () 42)))")); // made again, not the pool that's gone
+  delete use_workers(saved);
+}
+
+void pmap_benchmark() {
+  auto program = [](const char* map) {
+    return string("(letrec map (lambda (f l) (? l (. (f (head l)) (map f (tail l))) nil))"
+      "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+      "(letrec range (lambda (n) (? (= n 0) nil (. 17 (range (- n 1)))))"
+      "(letrec sum (lambda (l) (? l (+ (head l) (sum (tail l))) 0))"
+      "(sum (") + map + " fib (range 64)))))))";
+  };
+  string sequential = program("map"), parallel = program("pmap");
+  int expected = 0;
+  double sequential_ms = time_ms([&]{ expected = converted_compile_eval(sequential.c_str()); });
+  assert(expected == 64 * 1597);
+  std::cout << "64 x fib 17: map " << sequential_ms << "ms" << std::endl;
+  WorkPool* saved = use_workers(nullptr);
+  size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    WorkPool pool(threads);
+    use_workers(&pool);
+    int r = 0;
+    double ms = time_ms([&]{ r = converted_compile_eval(parallel.c_str()); });
+    assert(r == expected);
+    std::cout << "64 x fib 17: pmap on " << threads << " workers " << ms << "ms, speedup " << sequential_ms / ms <<
+      ", " << pool.steals << " tasks stolen" << std::endl;
+  }
+  use_workers(saved);
+  reset_allocator();
+}
+
+// -- bytecode
+// classic syntax compiled for a stack machine, whose stack is shadow_stack so everything on it is a root
+
+size_t emit(uint32_t op) {
+  code.push_back(op);
+  return code.size() - 1;
+}
+
+size_t emit(uint32_t op, size_t arg) { // returns the position of arg for patching
+  code.push_back(op);
+  code.push_back(arg);
+  return code.size() - 1;
+}
+
+size_t add_const(size_t v) {
+  code_consts.push_back(v);
+  return code_consts.size() - 1;
+}
+
+void emit_value(size_t v) {
+  if (!v || is_imm(v) || vars[v].h == tSymbol) // never moved
+    emit(kImm, v);
+  else
+    emit(kConst, add_const(v));
+}
+
+void compile(size_t n, bool tail) { // in tail position the code returns, or tail calls, by itself
+  if (!n || is_int(n) || vars[n].h == tSymbol)
+    emit_value(n);
+  else if (vars[n].h == tLocal || vars[n].h == tCaptured)
+    emit(vars[n].h == tLocal ? kLocal : kCaptured, vars[n].t);
+  else if (vars[n].h == tGlobal) // the symbol is a const, as the transpiled code may have other handles for symbols
+    emit(kGlobal, add_const(vars[n].t));
+  else {
+    size_t fn = h(n), args = t(n);
+    switch (fn) {
+    case tLit: emit_value(t(n)); break;
+    case tIf: {
+      compile(h(args), false);
+      size_t to_else = emit(kJumpIfNot, 0);
+      compile(h(t(args)), tail);
+      size_t to_end = tail ? 0 : emit(kJump, 0);
+      code[to_else] = code.size();
+      compile(h(t(t(args))), tail);
+      if (!tail)
+        code[to_end] = code.size();
+      return;
+    }
+    case tAdd: case tSub: case tMul: case tLt: case tEq: case tCon:
+      compile(h(args), false);
+      compile(h(t(args)), false);
+      if (fn == tLt || fn == tEq)
+        emit(fn - tAdd + kAdd, add_const(fn)); // true is the builtin, as in eval
+      else
+        emit(fn - tAdd + kAdd);
+      break;
+    case tHead: case tTail:
+      compile(h(args), false);
+      emit(fn - tAdd + kAdd);
+      break;
+    case tLambda: { // captured values, kClosure capture_count end param_count frame_size, then the body
+      size_t info = h(args), count = 0;
+      for (size_t c = t(t(info)); c; c = t(c), count++)
+        compile(h(c), false);
+      size_t to_end = emit(kClosure, count) + 1;
+      code.push_back(0);
+      code.push_back(param_count(info));
+      code.push_back(frame_size(info));
+      compile(h(t(args)), true);
+      code[to_end] = code.size();
+      break;
+    }
+    case tLet: case tLetRec: // (let $slot initializer body), as in eval
+      if (t(t(t(args)))) {
+        emit_value(0);
+        emit_value(0);
+        emit(kCons);
+        emit(kSetLocal, vars[h(args)].t);
+      }
+      compile(h(t(args)), false);
+      emit(t(t(t(args))) ? kPatchLocal : kSetLocal, vars[h(args)].t);
+      compile(h(t(t(args))), tail);
+      return;
+    case tDefine: // (define global_ref initializer body)
+      compile(h(t(args)), false);
+      emit(kDefine, add_const(vars[h(args)].t));
+      compile(h(t(t(args))), tail);
+      return;
+    default: {
+      compile(fn, false);
+      size_t count = 0;
+      for (; args; args = t(args), count++)
+        compile(h(args), false);
+      emit(tail ? kTailCall : kCall, count);
+      return;
+    }
+    }
+  }
+  if (tail)
+    emit(kRet);
+}
+
+void compile_program(size_t n) {
+  code.assign(1, kHalt);
+  code_consts.clear();
+  compile(n, true);
+}
+
+size_t vm_run(size_t context) {
+  nursery_enabled = gc_on_alloc = true;
+  Root ctx(context);
+  Stack<size_t>& s = shadow_stack;
+  size_t base = s.size();
+  s.append(code_consts.begin(), code_consts.end());
+  s.push_back(0); // return frame: saved ctx and pc
+  s.push_back(mk_int(0));
+  for (size_t pc = 1;;) {
+    if (trace_eval)
+      std::cout << pc << ": " << op_names[code[pc]] << ", depth " << s.size() - base << std::endl;
+    switch (code[pc++]) {
+    case kHalt: {
+      size_t r = s.back();
+      s.resize(base);
+      return r;
+    }
+    case kImm: s.push_back(code[pc++]); break;
+    case kConst: s.push_back(s[base + code[pc++]]); break;
+    case kLocal: s.push_back(get_slot(ctx, code[pc++])); break;
+    case kCaptured: s.push_back(get_slot(get_slot(ctx, 0), code[pc++])); break;
+    case kJump: pc = code[pc]; break;
+    case kJumpIfNot: {
+      size_t cond = s.back();
+      s.pop_back();
+      pc = cond ? pc + 1 : code[pc];
+      break;
+    }
+    case kClosure: {
+      size_t r = vm_closure(pc + 4);
+      s.push_back(r);
+      pc = code[pc + 1];
+      break;
+    }
+    case kCall: case kTailCall: {
+      bool tail = code[pc - 1] == kTailCall;
+      size_t count = code[pc++];
+      if (!vm_call(count, tail, pc, ctx) && tail)
+        vm_ret(pc, ctx);
+      break;
+    }
+    case kRet: vm_ret(pc, ctx); break;
+    case kSetLocal: set_slot(ctx, code[pc++], s.back()); s.pop_back(); break;
+    case kPatchLocal: patch_letrec(s.back(), get_slot(ctx, code[pc])); set_slot(ctx, code[pc++], s.back()); s.pop_back(); break;
+    case kGlobal: { // the inline cache: rewritten to kGlobalSlot once the slot is known
+      size_t slot = global_slot(s[base + code[pc]]);
+      if (inline_caches) {
+        code[pc - 1] = kGlobalSlot;
+        code[pc] = slot;
+      }
+      s.push_back(get_global(slot));
+      pc++;
+      break;
+    }
+    case kGlobalSlot: s.push_back(get_global(code[pc++])); break;
+    case kDefine: set_global(global_slot(s[base + code[pc++]]), s.back()); s.pop_back(); break;
+    case kAdd: case kSub: case kMul: {
+      int b = get_int(s.back());
+      s.pop_back();
+      int a = get_int(s.back());
+      int r = code[pc - 1] == kAdd ? a + b : code[pc - 1] == kSub ? a - b : a * b;
+      s.back() = mk_int(r);
+      break;
+    }
+    case kLt: case kEq: {
+      size_t yes = s[base + code[pc]];
+      int b = get_int(s.back());
+      s.pop_back();
+      int a = get_int(s.back());
+      s.back() = (code[pc - 1] == kLt ? a < b : a == b) ? yes : 0;
+      pc++;
+      break;
+    }
+    case kCons: {
+      size_t r = mk_pair(s[s.size() - 2], s.back());
+      s.pop_back();
+      s.back() = r;
+      break;
+    }
+    case kHead: s.back() = h(s.back()); break;
+    case kTail: s.back() = t(s.back()); break;
+    }
+  }
+}
+
+int bytecode_compile_eval(const char* s) {
+  size_t ctx = reset_global_ctx();
+  size_t fn = parse_program(s);
+  if (s == &error_marker || *s)
+    return printf("error at %s", s), -1;
+  compile_program(resolve(fn, false));
+  return get_int(vm_run(ctx));
+}
+
+void bytecode_test() {
+  assert(2 == bytecode_compile_eval("(- 3 1)"));
+  assert(4 == bytecode_compile_eval("(let x (- 3 1) (+ x x))"));
+  assert(5 == bytecode_compile_eval("((lambda (a b) (+ a b)) 2 3)"));
+  assert(5 == bytecode_compile_eval("(? (< 3 1) 2 5)"));
+  assert(3 == bytecode_compile_eval("(let f + (+ 1 (f 1 1)))"));
+  assert(5 == bytecode_compile_eval("((lambda (f) (f (< 3 1) 2 5)) ?)"));
+  assert(9 == bytecode_compile_eval("(letrec fs (. (lambda (n) (? (< 0 n) ((head fs) (- n 1)) 9)) nil) ((head fs) 4))"));
+  assert(7 == bytecode_compile_eval("(let add (lambda (a) (lambda (b) (+ a b))) ((add 3) 4))"));
+  assert(7 == bytecode_compile_eval("(+ 1 (let x 2 (* 3 x)))"));
+  assert(4 == bytecode_compile_eval(R"-(
+    (letrec len
+      (lambda (l)
+        (? l
+          (+ 1 (len (tail l)))
+          0
+        )
+      )
+      (len (' 1 2 3 4))
+    ))-"));
+  assert(55 == bytecode_compile_eval(
+    "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 10))"));
+  assert(100000 == bytecode_compile_eval(R"-(
+    (letrec range (lambda (n) (? (= n 0) nil (. n (range (- n 1)))))
+      (letrec len (lambda (l c) (? l (len (tail l) (+ c 1)) c))
+        (len (range 100000) 0))))-")); // the non tail recursion of range is on shadow_stack, not the C stack
+  assert(1 == bytecode_compile_eval(R"-(
+    (define even (lambda (n) (? (= n 0) 1 (odd (- n 1)))))
+    (define odd (lambda (n) (? (= n 0) 0 (even (- n 1)))))
+    (even 10))-"));
+  size_t cached = 0;
+  for (size_t pc = 1; pc < code.size(); pc += op_sizes[code[pc]]) {
+    assert(code[pc] != kGlobal);
+    cached += code[pc] == kGlobalSlot;
+  }
+  assert(cached == 3);
+  assert(12 == bytecode_compile_eval("(define x 5) (define f (lambda (y) (+ x y))) (define x 7) (f 5)"));
+}
+
+void bytecode_benchmark() {
+  const char* const programs[][2] = {
+    {"fib 25", "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 25))"},
+    {"tak 18 12 6", R"-(
+      (letrec tak (lambda (x y z) (? (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z))
+        (tak 18 12 6)))-"},
+    {"list-length 100000", R"-(
+      (letrec range (lambda (n acc) (? (= n 0) acc (range (- n 1) (. n acc))))
+        (letrec len (lambda (l c) (? l (len (tail l) (+ c 1)) c))
+          (len (range 100000 nil) 0))))-"},
+    {"outer variables 300000", R"-(
+      (let a 1 (let b 2 (let c 3 (let d 4 (let e 5
+        (letrec loop (lambda (n acc) (? (= n 0) acc (loop (- n 1) (+ acc (+ a e)))))
+          (loop 300000 0))))))))-"},
+  };
+  for (auto& p : programs) {
+    int classic = 0, bytecode = 0;
+    double classic_ms = time_ms([&]{ classic = compile_eval(p[1]); });
+    double bytecode_ms = time_ms([&]{ bytecode = bytecode_compile_eval(p[1]); });
+    assert(classic == bytecode);
+    std::cout << p[0] << ": classic " << classic_ms << "ms, bytecode " << bytecode_ms << "ms" << std::endl;
+  }
+  reset_allocator();
+}
+
+void globals_benchmark() {
+  const char* program = R"-(
+    (define even (lambda (n) (? (= n 0) 1 (odd (- n 1)))))
+    (define odd (lambda (n) (? (= n 0) 0 (even (- n 1)))))
+    (define fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+    (+ (even 300000) (fib 22)))-";
+  for (bool cached : {false, true}) {
+    inline_caches = cached;
+    int classic = 0, bytecode = 0;
+    double classic_ms = time_ms([&]{ classic = compile_eval(program); });
+    double bytecode_ms = time_ms([&]{ bytecode = bytecode_compile_eval(program); });
+    assert(classic == 17712 && bytecode == classic);
+    std::cout << "global calls " << (cached ? "with" : "without") << " inline caches: classic " << classic_ms <<
+      "ms, bytecode " << bytecode_ms << "ms" << std::endl;
+  }
+  inline_caches = true;
+  reset_allocator();
+}
+
+void folding_benchmark() {
+  const char* const programs[][2] = {
+    {"c", "(letrec loop (lambda (n acc) (? (= n 0) acc (loop (- n 1) (+ acc (let k (* (+ 3 1) 5) (? (< k 10) 1 k)))))) (loop 300000 0))"},
+    {"p", R"-(
+      (((loop) loop 300000 0 loop ((r) r))
+        ((n acc self k) = n 0 ((z) ? z (() k acc) (() + 3 1 ((a) * a 5 ((b) < b 10 ((c) ? c
+          (() - n 1 ((m) + acc 1 ((s) self m s self k)))
+          (() - n 1 ((m) + acc b ((s) self m s self k))))))))))))-"},
+  };
+  for (auto& p : programs) {
+    bool cont_passing = *p[0] == 'p';
+    for (bool folded : {false, true}) {
+      int r = 0;
+      double ms = time_ms([&]{
+        reset_global_ctx();
+        const char* pos = p[1];
+        size_t fn = parse_program(pos);
+        if (folded)
+          fn = optimize(fn, cont_passing);
+        r = get_int((cont_passing ? cont_eval : eval)(resolve(fn, cont_passing), 0));
+      });
+      assert(r == 6000000);
+      std::cout << "constants in a loop 300000, " << (cont_passing ? "cont_eval" : "eval") <<
+        (folded ? " folded: " : ": ") << ms << "ms" << std::endl;
+    }
+  }
+  reset_allocator();
+}
+
+// -- threaded continuation passing
+// programs pre-decoded so that each step is one indirect jump to the handler of its builtin
+
+#if defined(__GNUC__) && !defined(LL_PORTABLE_DISPATCH)
+#define LL_COMPUTED_GOTO // labels as values, otherwise a switch dispatches
+#endif
+
+void compile_threaded_call(size_t n);
+
+void emit_params(size_t params, size_t count, vector<std::pair<size_t, size_t>>& lambdas) { // missing ones are nil
+  for (; count--; params = t(params)) {
+    size_t p = h(params);
+    bool pair = p && !is_imm(p) && vars[p].h < tVal;
+    if (pair && h(p) != tLit) {
+      lambdas.push_back({tcode.size(), p});
+      tcode.push_back(in_frame(p) ? 5 : 3);
+    } else if (p && !is_imm(p) && (vars[p].h == tLocal || vars[p].h == tCaptured))
+      tcode.push_back(vars[p].t << kParamBits | (vars[p].h == tLocal ? 2 : 4));
+    else {
+      if (pair)
+        p = t(p);
+      if (!p || is_imm(p) || vars[p].h == tSymbol) // never moved
+        tcode.push_back(p << kParamBits);
+      else {
+        tcode.push_back(tcode_consts.size() << kParamBits | 1);
+        tcode_consts.push_back(p);
+      }
+    }
+  }
+}
+
+void compile_threaded_call(size_t n) {
+  size_t fn = h(n), count = 0;
+  for (size_t p = t(n); p; p = t(p))
+    count++;
+  vector<std::pair<size_t, size_t>> lambdas; // param word and lambda, compiled after the words of this call
+  tcode_ops.push_back(tcode.size());
+  if (fn >= tIf && fn <= tTail) { // builtins take a fixed number of params
+    tcode.push_back(fn - tIf + oIf);
+    emit_params(t(n), fn < tHead ? 3 : 2, lambdas);
+  } else {
+    tcode.push_back(oCall);
+    emit_params(n, 1, lambdas);
+    tcode.push_back(count);
+    emit_params(t(n), std::max(count, size_t(3)), lambdas); // room for the params of a builtin in a variable
+  }
+  for (auto& l : lambdas) { // lambda ((param_count frame_size captures...) fn params...)
+    tcode[l.first] |= tcode.size() << kParamBits;
+    if (in_frame(l.second)) {
+      tcode.push_back(h(l.second) ? vars[h(l.second)].t : 0);
+      compile_threaded_call(t(l.second));
+      continue;
+    }
+    tcode.push_back(oLambda);
+    size_t info = h(l.second), count = 0;
+    for (size_t c = t(t(info)); c; c = t(c))
+      count++;
+    tcode.push_back(param_count(info));
+    tcode.push_back(frame_size(info));
+    tcode.push_back(count);
+    emit_params(t(t(info)), count, lambdas); // only references, so nothing is added to lambdas
+    compile_threaded_call(t(l.second));
+  }
+}
+
+void compile_threaded(size_t n) {
+  tcode.clear();
+  tcode_ops.clear();
+  tcode_consts.clear();
+  tcode_linked = false;
+  compile_threaded_call(n);
+}
+
+size_t threaded_run(size_t context) {
+  nursery_enabled = gc_on_alloc = true;
+  Root ctx(context);
+  Stack<size_t>& s = shadow_stack;
+  size_t base = s.size();
+  s.append(tcode_consts.begin(), tcode_consts.end());
+  size_t pc = 0, result = 0, op;
+#ifdef LL_COMPUTED_GOTO
+  static const void* const handlers[] = {
+    &&l_call, &&l_if, &&l_add, &&l_sub, &&l_mul, &&l_lt, &&l_eq, &&l_con, &&l_head, &&l_tail};
+  if (!tcode_linked)
+    for (size_t at : tcode_ops)
+      tcode[at] = uintptr_t(handlers[tcode[at]]);
+  tcode_linked = true;
+#define NEXT eval_steps++; goto *(const void*)tcode[pc]
+#define DISPATCH(o) goto *handlers[o]
+#else
+#define NEXT eval_steps++; op = tcode[pc]; goto dispatch
+#define DISPATCH(o) op = o; goto dispatch
+#endif
+  auto param = [&](size_t i) -> size_t {
+    uintptr_t w = tcode[pc + i];
+    switch (w & 7) {
+    case 0: return w >> kParamBits;
+    case 1: return s[base + (w >> kParamBits)];
+    case 3: return cps_closure(w >> kParamBits, ctx);
+    default: return cps_local(w, ctx);
+    }
+  };
+  auto jmp = [&](size_t value, size_t cont_at) { // false if there is no continuation and value is the result
+    uintptr_t w = tcode[pc + cont_at];
+    if ((w & 7) == 5) { // no allocation, the value goes to a slot of this frame
+      if (tcode[w >> kParamBits])
+        set_slot(ctx, tcode[w >> kParamBits], value);
+      pc = (w >> kParamBits) + 1;
+      gc_safepoint();
+      return true;
+    }
+    Root val(value);
+    size_t cont = param(cont_at);
+    if (!is_vector(cont))
+      return result = val, false;
+    cps_enter(cont, val, ctx, pc);
+    return true;
+  };
+  (void)op;
+  NEXT;
+#ifndef LL_COMPUTED_GOTO
+dispatch:
+  switch (op) {
+  case oCall: goto l_call;
+  case oIf: goto l_if;
+  case oAdd: goto l_add;
+  case oSub: goto l_sub;
+  case oMul: goto l_mul;
+  case oLt: goto l_lt;
+  case oEq: goto l_eq;
+  case oCon: goto l_con;
+  case oHead: goto l_head;
+  case oTail: goto l_tail;
+  }
+#endif
+l_call: {
+    size_t fn = param(1), count = tcode[pc + 2];
+    if (fn >= tIf && fn <= tTail) {
+      pc += 2; // the builtin finds its params where it expects them
+      DISPATCH(fn - tIf + oIf);
+    }
+    if (!is_vector(fn)) {
+      if (cont_eval_only(fn) || quotes_params(fn))
+        result = unsupported(fn);
+      else
+        result = fn ? fn : count ? param(3) : last_param(ctx); // nil returns its param, or the last bound value
+      goto done;
+    }
+    Root f(fn);
+    size_t entry = get_int(get_slot(fn, 0));
+    Root frame(mk_vector(tcode[entry + 2]));
+    set_slot(frame, 0, f);
+    for (size_t i = 0; i < tcode[entry + 1]; i++) // missing ones are nil, so slots match resolve
+      set_slot(frame, i + 1, i < count ? param(3 + i) : 0);
+    ctx = frame;
+    pc = cps_code(entry);
+    gc_safepoint();
+  }
+  NEXT;
+l_if: {
+    size_t at = param(1) ? 2 : 3;
+    if ((tcode[pc + at] & 7) == 5) {
+      jmp(0, at);
+      NEXT;
+    }
+    size_t fn = param(at);
+    if (!is_vector(fn)) {
+      result = fn;
+      goto done;
+    }
+    cps_enter(fn, 0, ctx, pc);
+  }
+  NEXT;
+l_add: if (!jmp(mk_int(get_int(param(1)) + get_int(param(2))), 3)) goto done; NEXT;
+l_sub: if (!jmp(mk_int(get_int(param(1)) - get_int(param(2))), 3)) goto done; NEXT;
+l_mul: if (!jmp(mk_int(get_int(param(1)) * get_int(param(2))), 3)) goto done; NEXT;
+l_lt: if (!jmp(get_int(param(1)) < get_int(param(2)) ? tLt : tNil, 3)) goto done; NEXT;
+l_eq: if (!jmp(get_int(param(1)) == get_int(param(2)) ? tEq : tNil, 3)) goto done; NEXT;
+l_con: {
+    Root head(param(1));
+    if (!jmp(mk_pair(head, param(2)), 3)) goto done;
+  }
+  NEXT;
+l_head: if (!jmp(h(param(1)), 2)) goto done; NEXT;
+l_tail: if (!jmp(t(param(1)), 2)) goto done; NEXT;
+done:
+  s.resize(base);
+  return result;
+#undef NEXT
+#undef DISPATCH
+}
+
+int threaded_compile_eval(const char* s) {
+  size_t ctx = reset_global_ctx();
+  size_t fn = parse(s);
+  if (s == &error_marker || *s)
+    return printf("error at %s", s), -1;
+  compile_threaded(resolve(fn, true));
+  return get_int(threaded_run(ctx));
+}
+
+void threaded_test() {
+  assert(2 == threaded_compile_eval("(- 3 1)"));
+  assert(4 == threaded_compile_eval("(- 3 1 ((x) + x x))"));
+  assert(5 == threaded_compile_eval("(((a b) + a b) 2 3)"));
+  assert(5 == threaded_compile_eval("(< 3 1 ((a) ? a 2 5))"));
+  assert(3 == threaded_compile_eval("(((f) f 1 2 ((x) x)) +)")); // a builtin in a variable
+  assert(7 == threaded_compile_eval("(((add) add 3 ((f) f 4 ((r) r))) ((a k) k ((b k2) + a b k2)))"));
+  assert(4 == threaded_compile_eval(R"-(
+    (((len) len (' 1 2 3 4) nil)
+      ((list r)
+        ((lnrec) lnrec 0  list lnrec r)
+        ((c l f r)
+          ? l
+            (() tail l ((tl) + 1 c ((inc) f inc tl f r)))
+            (() r c))
+      )
+    ))-"));
+}
+
+void frame_continuations_benchmark() {
+  const char* const programs[][2] = {
+    {"fib 22", R"-(
+      (((fib) fib 22 fib ((r) r))
+        ((n self k) < n 2 ((c) ? c (() k n)
+          (() - n 1 ((a) self a self ((fa) - n 2 ((b) self b self ((fb) + fa fb k)))))))))-"},
+    {"loop 300000", "(((loop) loop 300000 0 loop ((r) r)) ((n acc self k) = n 0 ((z) ? z (() k acc) "
+      "(() - n 1 ((m) + acc 1 ((s) self m s self k))))))"},
+  };
+  for (auto& p : programs)
+    for (bool in_frames : {false, true}) {
+      frame_continuations = in_frames;
+      int walked = 0, threaded = 0;
+      size_t before = allocations;
+      double walked_ms = time_ms([&]{ walked = cont_compile_eval(p[1]); });
+      size_t walked_allocations = allocations - before;
+      before = allocations;
+      double threaded_ms = time_ms([&]{ threaded = threaded_compile_eval(p[1]); });
+      assert(walked == threaded);
+      std::cout << p[0] << (in_frames ? ", continuations in frames" : ", continuations as closures") << ": cont_eval " <<
+        walked_allocations << " allocations " << walked_ms << "ms, threaded " << allocations - before << " allocations " <<
+        threaded_ms << "ms" << std::endl;
+    }
+  frame_continuations = true;
+  reset_allocator();
+}
+
+void threaded_benchmark() {
+  const char* const programs[][2] = {
+    {"fib 22", R"-(
+      (((fib) fib 22 fib ((r) r))
+        ((n self k) < n 2 ((c) ? c (() k n)
+          (() - n 1 ((a) self a self ((fa) - n 2 ((b) self b self ((fb) + fa fb k)))))))))-"},
+    {"list-length 100000", R"-(
+      (((range len) range 100000 nil range ((l) len l 0 len ((x) x)))
+        ((n acc self k) = n 0 ((z) ? z (() k acc) (() . n acc ((a) - n 1 ((n1) self n1 a self k)))))
+        ((l c self k) ? l (() tail l ((tl) + c 1 ((c1) self tl c1 self k))) (() k c))))-"},
+  };
+  for (auto& p : programs) {
+    int walked = 0, threaded = 0;
+    eval_steps = 0;
+    double walked_ms = time_ms([&]{ walked = cont_compile_eval(p[1]); });
+    size_t walked_steps = eval_steps;
+    eval_steps = 0;
+    double threaded_ms = time_ms([&]{ threaded = threaded_compile_eval(p[1]); });
+    assert(walked == threaded);
+    std::cout << p[0] << ": " << eval_steps << " steps, cont_eval " << walked_ms << "ms " <<
+      int(walked_steps / walked_ms / 1000) << "M steps/s, threaded " << threaded_ms << "ms " <<
+      int(eval_steps / threaded_ms / 1000) << "M steps/s" << std::endl;
+  }
+  reset_allocator();
+}
+
+// -- transpiler
+// writes the program compiled by compile_program or compile_threaded as C++ that includes only ll_runtime.h
+
+void emit_cell(std::ostream& out, size_t v) { // expression rebuilding a constant
+  if (!v || is_imm(v) || v < tUser)
+    out << v << "u";
+  else if (vars[v].h == tNum)
+    out << "mk_int(" << get_int(v) << ")";
+  else if (vars[v].h == tLocal || vars[v].h == tCaptured)
+    out << "mk_ref(" << (vars[v].h == tLocal ? "tLocal, " : "tCaptured, ") << vars[v].t << ")";
+  else if (vars[v].h == tSymbol) {
+    out << "get_symbol(\"";
+    for (const char* c = symbol_name(v); *c; c++)
+      out << (*c == '"' || *c == '\\' ? "\\" : "") << *c;
+    out << "\")";
+  } else {
+    out << "mk_pair(";
+    emit_cell(out, h(v));
+    out << ", ";
+    emit_cell(out, t(v));
+    out << ")";
+  }
+}
+
+template<typename T>
+void emit_program_data(std::ostream& out, const char* code_name, const vector<T>& words, const vector<size_t>& consts) {
+  out << "  " << code_name << ".assign({";
+  for (size_t i = 0; i < words.size(); i++)
+    out << (i % 16 ? " " : "\n    ") << words[i] << "u,";
+  out << "});\n  " << code_name << "_consts = {";
+  for (size_t c : consts) {
+    out << "\n    ";
+    emit_cell(out, c);
+    out << ",";
+  }
+  out << "};\n";
+}
+
+void transpile_bytecode(std::ostream& out) {
+  vector<bool> label(code.size() + 1);
+  label[0] = label[1] = true;
+  for (size_t pc = 1; pc < code.size(); pc += op_sizes[code[pc]]) {
+    if (code[pc] == kJump || code[pc] == kJumpIfNot)
+      label[code[pc + 1]] = true;
+    if (code[pc] == kClosure)
+      label[pc + 5] = label[code[pc + 2]] = true;
+    if (code[pc] == kCall)
+      label[pc + 2] = true;
+  }
+  out <<
+    "size_t compiled_run(size_t context) {\n"
+    "  nursery_enabled = gc_on_alloc = true;\n"
+    "  Root ctx(context);\n"
+    "  Stack<size_t>& s = shadow_stack;\n"
+    "  size_t base = s.size(), pc = 1;\n"
+    "  s.append(code_consts.begin(), code_consts.end());\n"
+    "  s.push_back(0);\n"
+    "  s.push_back(mk_int(0));\n";
+  for (size_t pc = 1; pc < code.size(); pc += op_sizes[code[pc]]) // globals are looked up once per run
+    if (code[pc] == kGlobal || code[pc] == kDefine)
+      out << "  size_t g" << pc << " = global_slot(s[base + " << code[pc + 1] << "]);\n";
+  out <<
+    "  goto L1;\n"
+    "L0: {\n"
+    "    size_t r = s.back();\n"
+    "    s.resize(base);\n"
+    "    return r;\n"
+    "  }\n";
+  for (size_t pc = 1; pc < code.size(); pc += op_sizes[code[pc]]) {
+    if (label[pc])
+      out << "L" << pc << ":\n";
+    size_t arg = op_sizes[code[pc]] > 1 ? code[pc + 1] : 0;
+    out << "  ";
+    switch (code[pc]) {
+    case kImm: out << "s.push_back(" << arg << "u);"; break;
+    case kConst: out << "s.push_back(s[base + " << arg << "]);"; break;
+    case kLocal: out << "s.push_back(get_slot(ctx, " << arg << "));"; break;
+    case kCaptured: out << "s.push_back(get_slot(get_slot(ctx, 0), " << arg << "));"; break;
+    case kJump: out << "goto L" << arg << ";"; break;
+    case kJumpIfNot: out << "if (!s.back()) { s.pop_back(); goto L" << arg << "; }\n  s.pop_back();"; break;
+    case kClosure: out << "{\n    size_t r = vm_closure(" << pc + 5 << ");\n    s.push_back(r);\n  }\n  goto L" << code[pc + 2] << ";"; break;
+    case kCall: out << "pc = " << pc + 2 << ";\n  if (vm_call(" << arg << ", false, pc, ctx)) goto dispatch;"; break;
+    case kTailCall: out << "if (!vm_call(" << arg << ", true, pc, ctx)) vm_ret(pc, ctx);\n  goto dispatch;"; break;
+    case kRet: out << "vm_ret(pc, ctx);\n  goto dispatch;"; break;
+    case kSetLocal: out << "set_slot(ctx, " << arg << ", s.back());\n  s.pop_back();"; break;
+    case kPatchLocal:
+      out << "patch_letrec(s.back(), get_slot(ctx, " << arg << "));\n  set_slot(ctx, " << arg << ", s.back());\n  s.pop_back();";
+      break;
+    case kGlobal: out << "s.push_back(get_global(g" << pc << "));"; break;
+    case kDefine: out << "set_global(g" << pc << ", s.back());\n  s.pop_back();"; break;
+    case kAdd: case kSub: case kMul: case kLt: case kEq: {
+      const char* op = code[pc] == kAdd ? "+" : code[pc] == kSub ? "-" : code[pc] == kMul ? "*" : code[pc] == kLt ? "<" : "==";
+      out << "{\n    int b = get_int(s.back());\n    s.pop_back();\n    s.back() = ";
+      if (code[pc] == kLt || code[pc] == kEq)
+        out << "get_int(s.back()) " << op << " b ? s[base + " << arg << "] : 0;";
+      else
+        out << "mk_int(get_int(s.back()) " << op << " b);";
+      out << "\n  }";
+      break;
+    }
+    case kCons: out << "{\n    size_t r = mk_pair(s[s.size() - 2], s.back());\n    s.pop_back();\n    s.back() = r;\n  }"; break;
+    case kHead: out << "s.back() = h(s.back());"; break;
+    case kTail: out << "s.back() = t(s.back());"; break;
+    }
+    out << "\n";
+  }
+  out << "dispatch:\n  switch (pc) {\n";
+  for (size_t pc = 0; pc < label.size(); pc++)
+    if (label[pc])
+      out << "  case " << pc << ": goto L" << pc << ";\n";
+  out << "  }\n  return 0;\n}\n\n";
+  out << "int main() {\n  size_t ctx = reset_global_ctx();\n";
+  emit_program_data(out, "code", code, code_consts);
+}
+
+string cps_param_expr(uintptr_t w) {
+  string v = std::to_string(w >> kParamBits);
+  switch (w & 7) {
+  case 0: return v + "u";
+  case 1: return "s[base + " + v + "]";
+  case 2: return "get_slot(ctx, " + v + ")";
+  case 3: return "cps_closure(" + v + ", ctx)";
+  default: return "get_slot(get_slot(ctx, 0), " + v + ")";
+  }
+}
+
+void emit_cps_enter(std::ostream& out, uintptr_t w, const string& val, bool returns_fn) { // enters the lambda in param w
+  if ((w & 7) == 5) { // continuation in this frame
+    if (tcode[w >> kParamBits])
+      out << "    set_slot(ctx, " << tcode[w >> kParamBits] << ", " << val << ");\n";
+    out << "    gc_safepoint();\n    goto L" << (w >> kParamBits) + 1 << ";\n";
+  } else if ((w & 7) == 3) { // known lambda, entered without dispatch
+    out << "    cps_enter(" << cps_param_expr(w) << ", " << val << ", ctx, pc);\n    goto L" << cps_code(w >> kParamBits) << ";\n";
+  } else if ((w & 7) == 2 || (w & 7) == 4) {
+    out << "    {\n      size_t k = " << cps_param_expr(w) << ";\n"
+      "      if (!is_vector(k)) {\n        result = " << (returns_fn ? "k" : val) << ";\n        goto done;\n      }\n"
+      "      cps_enter(k, " << val << ", ctx, pc);\n      goto dispatch;\n    }\n";
+  } else
+    out << "    result = " << (returns_fn ? cps_param_expr(w) : val) << ";\n    goto done;\n";
+}
+
+void transpile_threaded(std::ostream& out) {
+  out <<
+    "size_t compiled_run(size_t context) {\n"
+    "  nursery_enabled = gc_on_alloc = true;\n"
+    "  Root ctx(context);\n"
+    "  Stack<size_t>& s = shadow_stack;\n"
+    "  size_t base = s.size(), pc = 0, result = 0;\n"
+    "  s.append(tcode_consts.begin(), tcode_consts.end());\n";
+  for (size_t at : tcode_ops) {
+    auto param = [&](size_t i) { return cps_param_expr(tcode[at + i]); };
+    out << "L" << at << ": {\n";
+    switch (tcode[at]) {
+    case oIf:
+      out << "    if (" << param(1) << ") {\n";
+      emit_cps_enter(out, tcode[at + 2], "0", true);
+      out << "    }\n";
+      emit_cps_enter(out, tcode[at + 3], "0", true);
+      break;
+    case oAdd: case oSub: case oMul:
+      out << "    Root v(mk_int(get_int(" << param(1) << ") " << "+-*"[tcode[at] - oAdd] << " get_int(" << param(2) << ")));\n";
+      emit_cps_enter(out, tcode[at + 3], "v", false);
+      break;
+    case oLt: case oEq:
+      out << "    Root v(get_int(" << param(1) << ") " << (tcode[at] == oLt ? "<" : "==") << " get_int(" << param(2) << ") ? " <<
+        (tcode[at] == oLt ? "tLt" : "tEq") << " : tNil);\n";
+      emit_cps_enter(out, tcode[at + 3], "v", false);
+      break;
+    case oCon:
+      out << "    Root head(" << param(1) << ");\n    Root v(mk_pair(head, " << param(2) << "));\n";
+      emit_cps_enter(out, tcode[at + 3], "v", false);
+      break;
+    case oHead: case oTail:
+      out << "    Root v(" << (tcode[at] == oHead ? "h(" : "t(") << param(1) << "));\n";
+      emit_cps_enter(out, tcode[at + 2], "v", false);
+      break;
+    default: { // oCall
+      uintptr_t fn = tcode[at + 1];
+      size_t count = tcode[at + 2];
+      string no_lambda = "cont_eval_only(fn) || quotes_params(fn) ? unsupported(fn) : fn ? size_t(fn) : " + (count ? param(3) : string("last_param(ctx)")); // nil returns its param
+      if ((fn & 7) == 3) { // known lambda
+        size_t entry = fn >> kParamBits;
+        out << "    Root fn(" << param(1) << ");\n    Root frame(mk_vector(" << tcode[entry + 2] << "));\n"
+          "    set_slot(frame, 0, fn);\n";
+        for (size_t i = 0; i < tcode[entry + 1] && i < count; i++)
+          out << "    set_slot(frame, " << i + 1 << ", " << param(3 + i) << ");\n";
+        out << "    ctx = frame;\n    gc_safepoint();\n    goto L" << cps_code(entry) << ";\n";
+        break;
+      }
+      out << "    Root fn(" << param(1) << ");\n"
+        "    if (fn >= tIf && fn <= tTail) {\n"
+        "      Root a(" << param(3) << "), b(" << param(4) << "), c(" << param(5) << ");\n"
+        "      if (!cps_apply(fn, a, b, c, ctx, pc, result))\n        goto done;\n"
+        "      goto dispatch;\n    }\n"
+        "    if (!is_vector(fn)) {\n      result = " << no_lambda << ";\n      goto done;\n    }\n"
+        "    size_t entry = get_int(get_slot(fn, 0))" << (count ? ", params = tcode[entry + 1]" : "") << ";\n"
+        "    Root frame(mk_vector(tcode[entry + 2]));\n"
+        "    set_slot(frame, 0, fn);\n";
+      for (size_t i = 0; i < count; i++)
+        out << "    if (params > " << i << ")\n      set_slot(frame, " << i + 1 << ", " << param(3 + i) << ");\n";
+      out << "    ctx = frame;\n    pc = cps_code(entry);\n    gc_safepoint();\n    goto dispatch;\n";
+    }
+    }
+    out << "  }\n";
+  }
+  out << "dispatch:\n  switch (pc) {\n";
+  for (size_t at : tcode_ops)
+    out << "  case " << at << ": goto L" << at << ";\n";
+  out << "  }\ndone:\n  s.resize(base);\n  return result;\n}\n\n";
+  out << "int main() {\n  size_t ctx = reset_global_ctx();\n";
+  emit_program_data(out, "tcode", tcode, tcode_consts);
+}
+
+void transpile(std::ostream& out, size_t program, bool cont_passing) { // program is resolved
+  out << "// generated by ll -x, build with ll_runtime.h on the include path\n#include \"ll_runtime.h\"\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-label\" // labels are emitted for all possible targets\n\n";
+  if (cont_passing) {
+    compile_threaded(program);
+    transpile_threaded(out);
+  } else {
+    compile_program(program);
+    transpile_bytecode(out);
+  }
+  out << "  std::cout << format(compiled_run(ctx)) << std::endl;\n  return 0;\n}\n";
+}
+
+void transpile_test() {
+  reset_global_ctx();
+  const char* pos;
+  std::ostringstream classic, cont_passing;
+  transpile(classic, resolve(parse(pos = "((lambda (a b) (+ a b)) 2 3)"), false), false);
+  assert(classic.str().find("#include \"ll_runtime.h\"\n") != string::npos && classic.str().find(".cpp") == string::npos);
+  assert(classic.str().find("s.back() = mk_int(get_int(s.back()) + b);") != string::npos);
+  assert(classic.str().find("if (!vm_call(2, true, pc, ctx)) vm_ret(pc, ctx);") != string::npos); // tail call
+  transpile(cont_passing, resolve(parse(pos = "(((a b) + a b) 2 3)"), true), true);
+  assert(cont_passing.str().find("Root v(mk_int(get_int(get_slot(ctx, 1)) + get_int(get_slot(ctx, 2))));") != string::npos);
+  assert(cont_passing.str().find("goto L10;") != string::npos); // the known lambda is entered directly
+  std::ostringstream defines;
+  transpile(defines, resolve(parse_program(pos = "(define a 1) (+ a a)"), false), false);
+  assert(defines.str().find("set_global(g3, s.back());") != string::npos);
+  assert(defines.str().find("s.push_back(get_global(g5));") != string::npos);
+}
+
+void transpile_benchmark() { // the native timings are opt-in, as they need a C++ compiler: LL_CXX=c++ ll -b
+  const char* cxx = getenv("LL_CXX");
+  if (!cxx || !*cxx) {
+    std::cout << "transpiled fib 27: set LL_CXX to a C++ compiler to time it" << std::endl;
+    return;
+  }
+  string runtime_dir = __FILE__; // ll_runtime.h is next to this file
+  runtime_dir = runtime_dir.find('/') == string::npos ? "." : runtime_dir.substr(0, runtime_dir.rfind('/'));
+  string dir = (std::filesystem::temp_directory_path() / "ll_transpiled_XXXXXX").string();
+  if (!mkdtemp(&dir[0])) {
+    std::cout << "transpiled fib 27: can't make a directory in " << std::filesystem::temp_directory_path() << std::endl;
+    return;
+  }
+  const char* const programs[][2] = {
+    {"c", "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 27))"},
+    {"p", R"-(
+      (((fib) fib 27 fib ((r) r))
+        ((n self k) < n 2 ((c) ? c (() k n)
+          (() - n 1 ((a) self a self ((fa) - n 2 ((b) self b self ((fb) + fa fb k)))))))))-"},
+  };
+  for (auto& p : programs) {
+    bool cont_passing = *p[0] == 'p';
+    double interpreted_ms = time_ms([&]{ (cont_passing ? cont_compile_eval : compile_eval)(p[1]); });
+    reset_global_ctx();
+    const char* pos = p[1];
+    size_t fn = resolve(parse(pos), cont_passing);
+    {
+      std::ofstream out(dir + "/program.cpp");
+      transpile(out, fn, cont_passing);
+    }
+    int status = 0;
+    string compile = string(cxx) + " -O2 -std=c++17 -pthread -I'" + runtime_dir + "' -o '" + dir + "/program' '" + dir + "/program.cpp'";
+    double compile_ms = time_ms([&]{ status = system(compile.c_str()); });
+    if (status) {
+      std::cout << "transpiled fib 27: failed " << compile << std::endl;
+      continue;
+    }
+    double native_ms = time_ms([&]{ status = system(("'" + dir + "/program' > /dev/null").c_str()); });
+    std::cout << "fib 27 " << (cont_passing ? "continuation passing" : "classic") << ": " <<
+      (cont_passing ? "cont_eval " : "eval ") << interpreted_ms << "ms, transpiled " << native_ms <<
+      "ms (process included) after compiling for " << compile_ms << "ms" << std::endl;
+  }
+  std::filesystem::remove_all(dir);
+  reset_allocator();
+}
+
+// -- interpreters
+// the heap, symbols and code are thread_local, so each thread is an interpreter with its own state
+
+size_t prepare_program(size_t fn) { // parsed program to the form run_prepared expects in the current mode
+  if (converting)
+    fn = to_continuation_passing(optimizing ? optimize(fn, false) : fn);
+  if (optimizing)
+    fn = optimize(fn, cont_passing_mode);
+  return resolve(fn, cont_passing_mode);
+}
+
+size_t run_prepared(size_t fn, size_t ctx) {
+  if (bytecode_mode) {
+    compile_program(fn);
+    return vm_run(ctx);
+  }
+  if (threaded_mode) {
+    compile_threaded(fn);
+    return threaded_run(ctx);
+  }
+  return (cont_passing_mode ? cont_eval : eval)(fn, ctx);
+}
+
+string run_program(const string& program) { // formatted result, or the parse error
+  size_t ctx = reset_global_ctx();
+  const char* pos = program.c_str();
+  size_t fn = parse_program(pos);
+  skip_ws(pos);
+  if (pos == &error_marker)
+    return "not matched '(' at " + string(last_open_par);
+  if (*pos)
+    return "error at " + string(pos);
+  return format(run_prepared(prepare_program(fn), ctx));
+}
+
+void release_thread() { // frees the state that has no destructor
+  vars.release();
+  shadow_stack.release();
+  remembered.release();
+  vector_arena.release();
+  for (MarkBits* m : {&gc_marks, &format_marks, &format_shared})
+    m->release();
+}
+
+class Interpreter { // runs jobs in order on its own thread
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> jobs;
+  bool stopping = false;
+  std::thread thread; // started last, when the queue is ready
+
+  void loop() {
+    reset_global_ctx(); // globals take shadow_stack[0] before any Root
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]{ return stopping || !jobs.empty(); });
+        if (jobs.empty())
+          break;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+    release_thread();
+  }
+
+public:
+  Interpreter() : thread([this]{ loop(); }) {}
+  Interpreter(const Interpreter&) = delete;
+  ~Interpreter() { // finishes the queued jobs
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
+  void post(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+  }
+  std::future<string> submit(const string& program) {
+    auto task = std::make_shared<std::packaged_task<string()>>([program]{ return run_program(program); });
+    post([task]{ (*task)(); });
+    return task->get_future();
+  }
+  string run(const string& program) { return submit(program).get(); }
+};
+
+vector<string> run_batch(const vector<string>& programs, size_t threads) { // results in the order of programs
+  vector<string> results(programs.size());
+  std::atomic<size_t> next(0);
+  std::deque<Interpreter> pool(threads);
+  for (Interpreter& interpreter : pool)
+    interpreter.post([&]{
+      for (size_t i; (i = next++) < programs.size();)
+        results[i] = run_program(programs[i]);
+    });
+  pool.clear(); // waits for the jobs
+  return results;
+}
+
+void interpreter_test() {
+  cont_passing_mode = false; // the mode flags are shared, set before the interpreters run
+  Interpreter a, b;
+  std::future<string> x = a.submit("(define x 5) (define f (lambda (y) (+ x y))) (f 2)");
+  std::future<string> y = b.submit("(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 15))");
+  assert(x.get() == "7" && y.get() == "610");
+  assert(a.run("(define f 1) f") == "1"); // each program starts with empty globals
+  assert(b.run("(+ 1") == "not matched '(' at (+ 1");
+  vector<string> programs;
+  for (int i = 0; i < 40; i++)
+    programs.push_back("(letrec len (lambda (l) (? l (+ 1 (len (tail l))) 0)) (len (. " + std::to_string(i) + " (. 2 nil))))");
+  vector<string> results = run_batch(programs, 4);
+  for (const string& r : results)
+    assert(r == "2");
+  programs = {"(* 6 7)", "(- 1 2)", "(head (. 1 2))"};
+  assert(run_batch(programs, 8) == vector<string>({"42", "-1", "1"}));
+  cont_passing_mode = true;
+}
+
+void batch_benchmark() {
+  const string fib = "(letrec fib (lambda (n) (? (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 22))";
+  size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+  vector<string> programs(max_threads * 4, fib);
+  double single_ms = 0;
+  cont_passing_mode = false;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    vector<string> results;
+    double ms = time_ms([&]{ results = run_batch(programs, threads); });
+    assert(results.back() == "17711");
+    if (threads == 1)
+      single_ms = ms;
+    std::cout << "batch of " << programs.size() << " fib 22, " << threads << " interpreters: " << ms << "ms, speedup " <<
+      single_ms / ms << std::endl;
+  }
+  cont_passing_mode = true;
+}
+
+void show_help() {
+   std::cout <<
+     "little-lisp" << std::endl <<
+     "usage: ll -flags \"expression or filename\"" << std::endl <<
+     "where flags are:" << std::endl <<
+     "  t - run self tests" << std::endl <<
+     "  h - this help" << std::endl <<
+     "  b - run benchmarks, with transpiled programs too if LL_CXX names a C++ compiler" << std::endl <<
+     "  g - show gc statistics" << std::endl <<
+     "  v - varbose evaluation trace" << std::endl <<
+     "  mN - limit heap to N slots (default 16M)" << std::endl <<
+     "  jN - mark and sweep with N threads" << std::endl <<
+     "  uN - or mark incrementally with pauses up to N microseconds" << std::endl <<
+     "  k - or compact lists into consecutive slots" << std::endl <<
+     std::endl <<
+     "  p - continuation passing mode (default)" << std::endl <<
+     "  c - or classic mode" << std::endl <<
+     "  s - or classic mode compiled to bytecode" << std::endl <<
+     "  d - or continuation passing mode pre-decoded to threaded code" << std::endl <<
+     "  e - or classic mode converted to continuation passing, run as threaded code if followed by d" << std::endl <<
+     "  x - print the program in the chosen syntax as C++ instead of running it" << std::endl <<
+     "  n - don't fold constants before running" << std::endl <<
+     "  q - report context switches per second of green threads (in p mode)" << std::endl <<
+     "  aN - run future and pmap on N worker threads (default one per core)" << std::endl <<
+     "  wN - run each of the parameters as a program on a pool of N interpreter threads" << std::endl <<
+     std::endl <<
+     "  r - return value as errorlevel" << std::endl <<
+     "  o - or return value to stdout (default)" << std::endl <<
+     std::endl <<
+     "  i - command line is an expression (default)" << std::endl <<
+     "  f - or command line is a file name" << std::endl;
+}
+
+size_t flag_number(const char*& p, size_t min, size_t max) { // parses N in flags like -m1000
+  char* end;
+  size_t r = strtoul(p + 1, &end, 10);
+  if (end == p + 1 || r < min || r > max) {
+    std::cerr << "expected number in " << min << ".." << max << " after '" << *p << "'" << std::endl;
+    rexit(-1);
+  }
+  p = end - 1;
+  return r;
+}
+
+string read_file(const char* name) {
+  std::ifstream file(name);
+  if (!file) {
+    std::cerr << "can't open '" << name << "'" << std::endl;
+    rexit(-1);
+  }
+  return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+int main(int param_cnt, const char* const* params) {
+  if (param_cnt < 2) {
+    std::cerr << "help: ll -h" << std::endl;
+    rexit(1);
+  }
+  bool immediate_mode = true;
+  bool to_result_code = false;
+  size_t batch_threads = 0;
+  while (param_cnt > 1 && *params[1] == '-') {
+    params++;
+    for (const char* p = *params; *++p;) {
+      switch(*p) {
+      case 't':
+        allocator_test();
+        gc_test();
+        generational_gc_test();
+        parallel_gc_test();
+        incremental_gc_test();
+        compaction_test();
+        vector_test();
+        global_ctx_test();
+        visualization_test();
+        parsing_test();
+        optimize_test();
+        resolve_test();
+        eval_test();
+        cont_eval_test();
+        quickening_test();
+        cps_conversion_test();
+        green_threads_test();
+        futures_test();
+        bytecode_test();
+        threaded_test();
+        transpile_test();
+        interpreter_test();
+        std::cout << "tests passed" << std::endl;
+        rexit(1);
+      case 'b':
+        gc_benchmark();
+        parallel_gc_benchmark();
+        compaction_benchmark();
+        bytecode_benchmark();
+        globals_benchmark();
+        folding_benchmark();
+        quickening_benchmark();
+        conversion_benchmark();
+        green_threads_benchmark();
+        pmap_benchmark();
+        threaded_benchmark();
+        frame_continuations_benchmark();
+        transpile_benchmark();
+        batch_benchmark();
+        rexit(0);
+      case 'g': trace_gc = true; break;
+      case 'v': trace_eval = true; break;
+      case 'j': gc_threads = flag_number(p, 1, ~size_t(0)); break;
+      case 'u': gc_pause_budget_us = flag_number(p, 1, ~size_t(0)); break;
+      case 'k': gc_compacting = true; break;
+      case 'm': max_slots = flag_number(p, kSegmentSize, kYoungBase - 1); break;
+      case 'c': cont_passing_mode = bytecode_mode = threaded_mode = converting = false; break;
+      case 'p': cont_passing_mode = true; bytecode_mode = threaded_mode = converting = false; break;
+      case 's': cont_passing_mode = threaded_mode = converting = false; bytecode_mode = true; break;
+      case 'e': cont_passing_mode = converting = true; bytecode_mode = threaded_mode = false; break;
+      case 'd': cont_passing_mode = threaded_mode = true; bytecode_mode = false; break;
+      case 'x': transpile_mode = true; break;
+      case 'n': optimizing = false; break;
+      case 'q': trace_switches = true; break;
+      case 'a': pool_threads = flag_number(p, 1, 1024); break;
+      case 'w': batch_threads = flag_number(p, 1, 1024); break;
+      case 'i': immediate_mode = true; break;
+      case 'f': immediate_mode = false; break;
+      case 'h': show_help(); rexit(0);
+      case 'r': to_result_code = true; break;
+      case 'o': to_result_code = false; break;
+      default:
+        std::cerr << "unknown flag '" << *p << "'" << std::endl;
+        rexit(-1);
       }
     }
     param_cnt--;
   }
+  if (batch_threads && param_cnt > 1) {
+    vector<string> programs;
+    for (int i = 1; i < param_cnt; i++)
+      programs.push_back(immediate_mode ? params[i] : read_file(params[i]));
+    for (const string& r : run_batch(programs, batch_threads))
+      std::cout << r << std::endl;
+    return 0;
+  }
   if (param_cnt != 2) {
     if (param_cnt > 2)
       std::cerr << "too many parameters (did you enclose expression in \"\"?)" << std::endl;
@@ -578,30 +3268,27 @@ int main(int param_cnt, const char* const* params) {
       std::cerr << "expected " << (immediate_mode ? "expression" : "file name") << std::endl;
     rexit(-1);
   }
-  string expression;
-  if (immediate_mode)
-    expression = params[1];
-  else
-  {
-    std::ifstream file(params[1]);
-    if (!file) {
-      std::cerr << "can't open '" << params[1] << "'" << std::endl;
-      rexit(-1);
-    }
-    expression.assign(
-      std::istreambuf_iterator<char>(file),
-      std::istreambuf_iterator<char>());
-  }
+  string expression = immediate_mode ? params[1] : read_file(params[1]);
   size_t ctx = reset_global_ctx();
   const char* expr_pos = expression.c_str();
-  size_t fn = parse(expr_pos);
+  size_t fn = parse_program(expr_pos);
   skip_ws(expr_pos);
   if (expr_pos == &error_marker)
       std::cerr << "not matched '(' at " << last_open_par << std::endl;
   else if (*expr_pos)
       std::cerr << "error at " << expr_pos << std::endl;
   else {
-    size_t result = (cont_passing_mode ? cont_eval : eval)(fn, ctx);
+    fn = prepare_program(fn);
+    if (transpile_mode) {
+      transpile(std::cout, fn, cont_passing_mode);
+      return 0;
+    }
+    size_t result;
+    double ms = time_ms([&]{ result = run_prepared(fn, ctx); });
+    if (trace_switches)
+      std::cout << context_switches << " context switches in " << ms << "ms, " << int(context_switches / ms) << "K/s" << std::endl;
+    if (trace_gc)
+      print_pause_histogram();
     if (to_result_code)
       rexit(get_int(result));
     else
@@ -0,0 +1,1219 @@
+// the runtime of chapter-last.cpp: allocator, GC, format, global_ctx, and what bytecode and threaded code call,
+// so the C++ that ll -x prints needs only this file. It defines its functions and state, so a program includes it once.
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <unordered_map>
+using std::unordered_map;
+#include <unordered_set>
+#include <memory>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+
+#define assert(E) if (!(E)) { std::cerr << "assert at " << __LINE__ << std::endl; rexit(-1);}
+
+[[noreturn]] void rexit(int i) {
+  exit(i);
+}
+
+bool trace_gc = false;
+size_t gc_threads = 1;
+size_t gc_pause_budget_us = 0; // if set, marking is incremental in slices of this duration
+bool gc_compacting = false;
+
+// -- allocator
+const size_t kSegmentBits = 16;
+const size_t kSegmentSize = size_t(1) << kSegmentBits;
+const size_t kIntBase = size_t(1) << 30; // handles in [kIntBase, tVal) are immediate 30-bit ints
+const size_t kNurserySize = kSegmentSize;
+const size_t kYoungBase = kIntBase - kNurserySize; // handles in [kYoungBase, kIntBase) are in nursery
+const size_t tVal = kIntBase << 1; // tags are above any possible handle
+const size_t tNum = tVal;   // boxed int, for values not fitting an immediate
+const size_t tSymbol = tVal + 1;
+const size_t tFree = tVal + 2;
+const size_t tMoved = tVal + 3; // nursery cell promoted to the address in t
+const size_t tLocal = tVal + 4; // variable reference made by resolve, t is the slot in the frame
+const size_t tCaptured = tVal + 5; // same, t is the slot in the closure of the frame
+const size_t tVector = tVal + 6;
+const size_t tGlobal = tVal + 7; // global variable reference made by resolve, t is its symbol until the first use
+const size_t tGlobalSlot = tVal + 8; // same after the first use, t is the slot in globals
+const size_t tTask = tVal + 9; // a future made by cont_eval, t is its index in future_tasks
+
+struct Var{
+  uint32_t h;
+  uint32_t t; // int bits if h == tNum, offset in symbol_arena if h == tSymbol, in vector_arena if h == tVector
+};
+
+size_t max_slots = size_t(1) << 24;
+
+struct Heap { // constant initialized, so a thread_local one is used without a guard
+  Var* segments[kIntBase >> kSegmentBits] = {}; // never moved once allocated, so handles stay valid
+  size_t old_segments = 0;
+  void init() { // by reset_allocator, the first thing to run on a thread
+    grow();
+    segments[kYoungBase >> kSegmentBits] = new Var[kNurserySize]();
+  }
+  Var& operator[] (size_t i) { return segments[i >> kSegmentBits][i & (kSegmentSize - 1)]; }
+  size_t capacity() { return old_segments << kSegmentBits; }
+  void grow() { segments[old_segments++] = new Var[kSegmentSize](); }
+  void release() {
+    for (Var*& s : segments) {
+      delete[] s;
+      s = nullptr;
+    }
+    old_segments = 0;
+  }
+};
+
+template <class T>
+struct Stack { // a vector with no constructor or destructor, for thread_local state on hot paths, see release_thread
+  static_assert(std::is_trivially_copyable<T>::value, "moved by realloc");
+  T* items = nullptr;
+  size_t count = 0, capacity = 0;
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  T* data() { return items; }
+  T* begin() { return items; }
+  T* end() { return items + count; }
+  const T* begin() const { return items; }
+  const T* end() const { return items + count; }
+  T& operator[] (size_t i) { return items[i]; }
+  const T& operator[] (size_t i) const { return items[i]; }
+  T& back() { return items[count - 1]; }
+  void push_back(T v) {
+    if (count == capacity)
+      reserve(capacity ? capacity * 2 : 256);
+    items[count++] = v;
+  }
+  template <class It>
+  void append(It first, It last) {
+    for (; first != last; ++first)
+      push_back(*first);
+  }
+  void pop_back() { count--; }
+  void clear() { count = 0; }
+  void resize(size_t n) {
+    reserve(n);
+    std::fill(items + std::min(n, count), items + n, T());
+    count = n;
+  }
+  void reserve(size_t n) {
+    if (n <= capacity)
+      return;
+    capacity = std::max(n, capacity * 2);
+    items = static_cast<T*>(std::realloc(items, capacity * sizeof(T)));
+  }
+  void release() {
+    std::free(items);
+    *this = Stack();
+  }
+};
+
+thread_local Heap vars;
+
+struct MarkBits { // one bit per slot, allocated per heap segment on first use
+  uint64_t* words[kIntBase >> kSegmentBits] = {};
+  uint64_t& word(size_t i) {
+    uint64_t*& w = words[i >> kSegmentBits];
+    if (!w)
+      w = new uint64_t[kSegmentSize / 64]();
+    return w[(i & (kSegmentSize - 1)) >> 6];
+  }
+  bool get(size_t i) { return word(i) >> (i & 63) & 1; }
+  bool set(size_t i) { // returns the previous state
+    uint64_t& w = word(i);
+    bool r = w >> (i & 63) & 1;
+    w |= uint64_t(1) << (i & 63);
+    return r;
+  }
+  void reset(size_t i) { word(i) &= ~(uint64_t(1) << (i & 63)); }
+  void release() {
+    for (auto& w : words) {
+      delete[] w;
+      w = nullptr;
+    }
+  }
+  bool get_shared(size_t i) { // thread-safe versions, need words to be allocated in advance
+    return __atomic_load_n(&words[i >> kSegmentBits][(i & (kSegmentSize - 1)) >> 6], __ATOMIC_RELAXED) >> (i & 63) & 1;
+  }
+  bool set_shared(size_t i) {
+    uint64_t bit = uint64_t(1) << (i & 63);
+    return __atomic_fetch_or(&words[i >> kSegmentBits][(i & (kSegmentSize - 1)) >> 6], bit, __ATOMIC_RELAXED) & bit;
+  }
+  void clear() {
+    for (auto w : words)
+      if (w)
+        std::fill(w, w + kSegmentSize / 64, 0);
+  }
+};
+
+thread_local MarkBits gc_marks;
+
+thread_local size_t max_var = 0;
+thread_local size_t allocated_count, first_free;
+thread_local size_t allocations = 0; // pairs, boxed ints and vectors ever made, for benchmarks
+thread_local bool nursery_enabled = false; // only where all roots are known to gc_minor
+thread_local size_t young_top = kYoungBase;
+thread_local Stack<size_t> remembered; // old cells pointing to the nursery
+thread_local size_t sweep_pos = 0, sweep_end = 0; // slots in [sweep_pos, sweep_end) are waiting for the lazy sweep
+thread_local size_t allocated_since_gc = 0, gc_threshold = kSegmentSize / 2; // see gc_adapt
+thread_local bool gc_marking = false; // incremental marking is in progress
+thread_local bool gc_on_alloc = false; // allocations can collect, as all live handles are in the shadow_stack
+thread_local Stack<size_t> shadow_stack; // GC roots, updated in place by moving collections
+
+struct Root { // registers a handle in shadow_stack for the lifetime of the scope
+  size_t index;
+  explicit Root(size_t v = 0) : index(shadow_stack.size()) { shadow_stack.push_back(v); }
+  Root(const Root&) = delete;
+  ~Root() { shadow_stack.pop_back(); }
+  operator size_t() const { return shadow_stack[index]; }
+  Root& operator= (size_t v) {
+    shadow_stack[index] = v;
+    return *this;
+  }
+  Root& operator= (const Root& v) { return *this = size_t(v); }
+};
+struct GlobalsRoot { // shadow_stack[0], reserved by the first reset_allocator on the thread
+  operator size_t() const { return shadow_stack[0]; }
+  GlobalsRoot& operator= (size_t v) {
+    shadow_stack[0] = v;
+    return *this;
+  }
+};
+thread_local GlobalsRoot globals; // vector of the values of global variables by slot, see global_ctx
+thread_local unordered_map<string, size_t> symbols;
+thread_local string symbol_arena; // zero-terminated names of all interned symbols
+thread_local Stack<uint32_t> vector_arena; // slot count followed by the slots, for each old vector
+thread_local vector<vector<uint32_t>> free_vectors; // offsets of released storage in vector_arena by slot count
+
+void reset_allocator() {
+  if (!vars.old_segments) {
+    assert(shadow_stack.empty());
+    vars.init();
+    shadow_stack.push_back(0);
+  }
+  symbols.clear();
+  symbols["nil"] = 0;
+  globals = 0;
+  symbol_arena.clear();
+  vector_arena.clear();
+  free_vectors.clear();
+  max_var = allocated_count = first_free = 0;
+  nursery_enabled = false;
+  young_top = kYoungBase;
+  remembered.clear();
+  sweep_pos = sweep_end = 0;
+  gc_marks.clear();
+  gc_marking = gc_on_alloc = false;
+  allocated_since_gc = 0;
+  gc_threshold = kSegmentSize / 2;
+}
+
+bool is_young(size_t v) { return v >= kYoungBase && v < kIntBase; }
+
+uint32_t* vector_at(size_t v) { // slot count, then the slots
+  return is_young(v) ? &vars[v].t : vector_arena.data() + vars[v].t; // in the nursery the slots follow the cell
+}
+
+void gc_sweep_step();
+void gc_push(size_t i);
+bool gc_urgent();
+void gc_collect_at_alloc(std::initializer_list<size_t> extra_roots);
+
+size_t alloc_old() {
+  while (!first_free && sweep_pos < sweep_end)
+    gc_sweep_step();
+  allocated_count++;
+  allocated_since_gc++;
+  size_t r;
+  if (first_free) {
+    r = first_free;
+    first_free = vars[first_free].t;
+  } else {
+    assert(max_var < max_slots - 1);
+    if (max_var + 1 == vars.capacity())
+      vars.grow();
+    r = ++max_var;
+  }
+  if (gc_marking || (r >= sweep_pos && r < sweep_end)) // allocate black while collection is in progress
+    gc_marks.set(r);
+  return r;
+}
+
+size_t alloc_var() {
+  allocations++;
+  if (nursery_enabled && young_top < kIntBase)
+    return young_top++;
+  return alloc_old();
+}
+
+void free_vector(size_t offset) {
+  size_t n = vector_arena[offset];
+  if (free_vectors.size() <= n)
+    free_vectors.resize(n + 1);
+  free_vectors[n].push_back(offset);
+}
+
+void free_var(size_t v) {
+    allocated_count--;
+    if (vars[v].h == tVector)
+      free_vector(vars[v].t);
+    vars[v].h = tFree;
+    vars[v].t = first_free;
+    first_free = v;
+}
+
+bool is_imm(size_t v) { return v >= kIntBase; }
+bool is_int(size_t v) { return is_imm(v) || vars[v].h == tNum; }
+int get_int(size_t v) {
+  return is_imm(v) ? int32_t(uint32_t(v) << 2) >> 2 :
+    vars[v].h == tNum ? int32_t(vars[v].t) : 0;
+}
+size_t h(size_t v) { return v < kIntBase && vars[v].h < tVal ? vars[v].h : 0; }
+size_t t(size_t v) { return v < kIntBase && vars[v].h < tVal ? vars[v].t : 0; }
+
+size_t mk_int(int v) {
+  if (v >= -int(kIntBase >> 1) && v < int(kIntBase >> 1))
+    return kIntBase | (uint32_t(v) & (kIntBase - 1));
+  if (gc_on_alloc && gc_urgent())
+    gc_collect_at_alloc({});
+  size_t r = alloc_var();
+  vars[r].h = tNum;
+  vars[r].t = uint32_t(v);
+  return r;
+}
+
+const char* symbol_name(size_t s) { return symbol_arena.c_str() + vars[s].t; }
+
+size_t get_symbol(const string& name) {
+  auto a = symbols.find(name);
+  if (a != symbols.end())
+    return a->second;
+  size_t r = alloc_old();
+  vars[r].h = tSymbol;
+  vars[r].t = symbol_arena.size();
+  symbol_arena.append(name.c_str(), name.size() + 1);
+  return symbols[name] = r;
+}
+size_t mk_pair(size_t h, size_t t) {
+  if (gc_on_alloc && gc_urgent())
+    gc_collect_at_alloc({h, t});
+  size_t r = alloc_var();
+  vars[r].h = h;
+  vars[r].t = t;
+  if (!is_young(r) && (is_young(h) || is_young(t))) // nursery was full
+    remembered.push_back(r);
+  return r;
+}
+
+void set_t(size_t pair, size_t t) { // write barrier for mutations of existing pairs
+  if (is_young(t) && !is_young(pair))
+    remembered.push_back(pair);
+  if (gc_marking && !is_young(vars[pair].t)) // keep the snapshot-at-the-beginning reachable
+    gc_push(vars[pair].t);
+  vars[pair].t = t;
+}
+
+void set_h(size_t pair, size_t h) { // same barrier as set_t
+  if (is_young(h) && !is_young(pair))
+    remembered.push_back(pair);
+  if (gc_marking && !is_young(vars[pair].h))
+    gc_push(vars[pair].h);
+  vars[pair].h = h;
+}
+
+size_t alloc_vector_storage(size_t n) { // n nil slots in vector_arena, returns the offset
+  allocated_since_gc += n / 2; // paced like the cells of a list of n
+  size_t offset;
+  if (n < free_vectors.size() && !free_vectors[n].empty()) {
+    offset = free_vectors[n].back();
+    free_vectors[n].pop_back();
+    std::fill_n(vector_arena.begin() + offset + 1, n, 0);
+  } else {
+    offset = vector_arena.size();
+    vector_arena.resize(offset + 1 + n);
+    vector_arena[offset] = n;
+  }
+  return offset;
+}
+
+size_t mk_vector(size_t n) { // n nil slots, contiguous
+  if (gc_on_alloc && gc_urgent())
+    gc_collect_at_alloc({});
+  size_t r, cells = 1 + (n + 1) / 2;
+  allocations++;
+  if (nursery_enabled && young_top + cells <= kIntBase) { // the slots take the next cells, two in each
+    r = young_top;
+    young_top += cells;
+    vars[r].t = n;
+    std::fill_n(&vars[r].t + 1, (cells - 1) * 2, 0); // with the padding, as gc_rescan may see these cells as pairs
+  } else {
+    r = alloc_old();
+    vars[r].t = alloc_vector_storage(n);
+  }
+  vars[r].h = tVector;
+  return r;
+}
+
+bool is_vector(size_t v) { return v && v < kIntBase && vars[v].h == tVector; }
+size_t vector_size(size_t v) { return vector_at(v)[0]; }
+size_t get_slot(size_t v, size_t i) { return vector_at(v)[1 + i]; }
+
+uint32_t* new_slots(size_t v) { // of a vector just allocated, to fill without barrier before allocating again
+  if (!is_young(v)) // the nursery was full, and the slots may refer to it
+    remembered.push_back(v);
+  return vector_at(v) + 1;
+}
+
+void set_slot(size_t v, size_t i, size_t x) { // same barrier as set_t
+  uint32_t& s = vector_at(v)[1 + i];
+  if (is_young(x) && !is_young(v))
+    remembered.push_back(v);
+  if (gc_marking && !is_young(s))
+    gc_push(s);
+  s = x;
+}
+
+// -- GC
+
+size_t mark_stack_limit = size_t(1) << 20;
+thread_local vector<size_t> mark_stack;
+thread_local bool mark_stack_overflow = false;
+
+void gc_push(size_t i) {
+  if (!i || is_imm(i) || gc_marks.get(i))
+    return;
+  if (mark_stack.size() >= mark_stack_limit) {
+    mark_stack_overflow = true; // recovered by gc_rescan
+    return;
+  }
+  __builtin_prefetch(&vars[i]);
+  mark_stack.push_back(i);
+}
+
+void gc_push_slots(size_t v) {
+  for (size_t i = 0, n = vector_size(v); i < n; i++)
+    gc_push(get_slot(v, i));
+}
+
+void gc_rescan() { // push unmarked children of all marked cells
+  auto scan = [](size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+      if (gc_marks.get(i) && vars[i].h < tVal) {
+        gc_push(vars[i].h);
+        gc_push(vars[i].t);
+      } else if (gc_marks.get(i) && vars[i].h == tVector)
+        gc_push_slots(i);
+    }
+  };
+  scan(1, max_var + 1);
+  scan(kYoungBase, young_top);
+}
+
+void gc_finish_sweep() {
+  while (sweep_pos < sweep_end)
+    gc_sweep_step();
+}
+
+bool gc_drain(size_t budget_us) { // marks all from mark_stack, or returns false when budget_us is over
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us);
+  size_t i = 0;
+  for (size_t steps = 1;; steps++) {
+    if (!i || is_imm(i)) {
+      if (!mark_stack.empty()) {
+        i = mark_stack.back();
+        mark_stack.pop_back();
+      } else if (mark_stack_overflow) {
+        mark_stack_overflow = false;
+        gc_rescan();
+        continue;
+      } else
+        return true;
+    }
+    if (budget_us && !(steps & 255) && std::chrono::steady_clock::now() > deadline) {
+      mark_stack.push_back(i);
+      return false;
+    }
+    size_t h = vars[i].h;
+    bool marked = gc_marks.set(i);
+    if (!marked && h == tVector)
+      gc_push_slots(i);
+    if (marked || h >= tVal) {
+      i = 0;
+      continue;
+    }
+    i = vars[i].t;
+    if (i && !is_imm(i))
+      __builtin_prefetch(&vars[i]);
+    gc_push(h);
+  }
+}
+
+void gc_mark(size_t i) {
+  gc_finish_sweep();
+  gc_push(i);
+  gc_drain(0);
+}
+
+bool gc_needed() {
+  return !gc_marking && sweep_pos >= sweep_end &&
+    (allocated_since_gc >= gc_threshold || allocated_count + 1 >= max_slots);
+}
+
+bool gc_urgent() { // too much allocated to wait for the next safepoint
+  return gc_needed() && (allocated_since_gc >= gc_threshold * 2 || allocated_count + 1 >= max_slots);
+}
+
+thread_local size_t freed_cnt, marked_cnt;
+
+uint64_t gc_dead_slots(size_t base, size_t end, MarkBits& marks = gc_marks) { // unmarked slots in [base, min(base + 64, end))
+  uint64_t live = marks.word(base) | (base ? 0 : 1);
+  if (end - base < 64)
+    live |= ~uint64_t(0) << (end - base);
+  return ~live;
+}
+
+bool is_collectable(size_t i, Heap& heap = vars) { // symbols are interned forever
+  return heap[i].h != tFree && heap[i].h != tSymbol;
+}
+
+double gc_growth = 1; // next collection after allocating this fraction of the live set
+
+void gc_adapt() { // sizes the heap and the next gc_threshold from the last collection results
+  size_t live = allocated_count;
+  double survival = marked_cnt + freed_cnt ? double(marked_cnt) / (marked_cnt + freed_cnt) : 0;
+  double growth = survival > 0.5 ? gc_growth * 2 : gc_growth; // mostly live data, collect less often
+  size_t target = std::min(max_slots, live + std::max(size_t(live * growth), kSegmentSize / 2) + 20);
+  while (vars.capacity() < target)
+    vars.grow();
+  target = std::min(target, vars.capacity());
+  gc_threshold = target > live + 20 ? target - live - 20 : 0;
+  if (trace_gc)
+    std::cout << "gc: swept, freed " << freed_cnt << ", marked " << marked_cnt <<
+      ", survival " << int(survival * 100) << "%, heap " << vars.capacity() <<
+      ", next gc after " << gc_threshold << " allocations" << std::endl;
+  if (target == max_slots && gc_threshold < max_slots / 64) {
+    std::cerr << "heap exhausted, live " << live << " of " << vars.capacity() << std::endl;
+    rexit(-1);
+  }
+}
+
+void gc_sweep_done() {
+  gc_marks.clear();
+  gc_adapt();
+}
+
+void gc_sweep_step() { // sweeps the next 64 slots
+  size_t base = sweep_pos;
+  marked_cnt += __builtin_popcountll(gc_marks.word(base));
+  for (uint64_t dead = gc_dead_slots(base, sweep_end); dead; dead &= dead - 1) {
+    size_t i = base + __builtin_ctzll(dead);
+    if (is_collectable(i)) {
+      free_var(i);
+      freed_cnt++;
+    }
+  }
+  sweep_pos += 64;
+  if (sweep_pos < sweep_end)
+    return;
+  sweep_pos = sweep_end = 0;
+  gc_sweep_done();
+}
+
+void gc_start_sweep() { // the actual sweeping is done by alloc_old on demand
+  allocated_since_gc = 0;
+  sweep_pos = 0;
+  sweep_end = max_var + 1;
+  freed_cnt = marked_cnt = 0;
+}
+
+void gc_sweep() {
+  gc_start_sweep();
+  gc_finish_sweep();
+}
+
+thread_local size_t pause_histogram[32]; // count of pauses by log2 of their duration in microseconds
+thread_local double max_pause_us = 0;
+
+struct gc_pause { // reports the time spent in its scope with -g
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ~gc_pause() {
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    max_pause_us = std::max(max_pause_us, us);
+    size_t bucket = 0;
+    while (bucket < 31 && size_t(us) >> bucket)
+      bucket++;
+    pause_histogram[bucket]++;
+    if (trace_gc)
+      std::cout << "gc: pause " << us << "us" << std::endl;
+  }
+};
+
+void print_pause_histogram() {
+  std::cout << "gc: max pause " << max_pause_us << "us" << std::endl;
+  for (size_t i = 0; i < 32; i++)
+    if (pause_histogram[i])
+      std::cout << "gc: pauses under " << (size_t(1) << i) << "us: " << pause_histogram[i] << std::endl;
+}
+
+void gc_mark_step() {
+  if (gc_drain(gc_pause_budget_us)) {
+    gc_marking = false;
+    gc_start_sweep();
+  }
+}
+
+size_t gc_promote(size_t v, vector<size_t>& to_scan) {
+  if (!is_young(v))
+    return v;
+  if (vars[v].h == tMoved)
+    return vars[v].t;
+  size_t r = alloc_old();
+  vars[r] = vars[v];
+  if (vars[r].h == tVector) { // the slots move to vector_arena
+    size_t n = vars[v].t;
+    vars[r].t = alloc_vector_storage(n);
+    std::copy_n(&vars[v].t + 1, n, vector_arena.begin() + vars[r].t + 1);
+  }
+  vars[v].h = tMoved;
+  vars[v].t = r;
+  to_scan.push_back(r);
+  return r;
+}
+
+void gc_minor() { // roots are shadow_stack, and mark_stack if marking is in progress
+  vector<size_t> to_scan(remembered.begin(), remembered.end());
+  remembered.clear();
+  size_t promoted = allocated_count;
+  for (size_t& r : shadow_stack)
+    r = gc_promote(r, to_scan);
+  if (gc_marking)
+    for (size_t& r : mark_stack)
+      r = gc_promote(r, to_scan);
+  while (!to_scan.empty()) {
+    Var& v = vars[to_scan.back()];
+    to_scan.pop_back();
+    if (v.h < tVal) {
+      v.h = gc_promote(v.h, to_scan);
+      v.t = gc_promote(v.t, to_scan);
+      if (gc_marking) { // promoted cells are allocated black, their children must not stay white
+        gc_push(v.h);
+        gc_push(v.t);
+      }
+    } else if (v.h == tVector) {
+      for (size_t i = v.t + 1; i <= v.t + vector_arena[v.t]; i++) { // by index, gc_promote can grow vector_arena
+        size_t s = gc_promote(vector_arena[i], to_scan);
+        vector_arena[i] = s;
+        if (gc_marking)
+          gc_push(s);
+      }
+    }
+  }
+  if (trace_gc)
+    std::cout << "gc: minor, nursery " << young_top - kYoungBase << ", promoted " << allocated_count - promoted << std::endl;
+  young_top = kYoungBase;
+}
+
+bool gc_minor_needed() {
+  return nursery_enabled && kIntBase - young_top < kNurserySize / 64;
+}
+
+// -- parallel GC
+
+struct MarkDeque { // owner works at the back, thieves take from the front
+  std::mutex m;
+  std::deque<size_t> items;
+  void push(size_t i) {
+    std::lock_guard<std::mutex> lock(m);
+    items.push_back(i);
+  }
+  bool pop(size_t& i) {
+    std::lock_guard<std::mutex> lock(m);
+    if (items.empty())
+      return false;
+    i = items.back();
+    items.pop_back();
+    return true;
+  }
+  bool empty() {
+    std::lock_guard<std::mutex> lock(m);
+    return items.empty();
+  }
+  bool steal(size_t& i) {
+    std::lock_guard<std::mutex> lock(m);
+    if (items.empty())
+      return false;
+    i = items.front();
+    items.pop_front();
+    return true;
+  }
+};
+
+template<typename F>
+void run_in_threads(size_t count, F f) { // the heap state is thread_local, so f gets it from its caller, not by name
+  vector<std::thread> threads;
+  for (size_t id = 1; id < count; id++)
+    threads.emplace_back(f, id);
+  f(0);
+  for (auto& t : threads)
+    t.join();
+}
+
+void gc_reserve_marks() {
+  for (size_t s = 0; s < vars.old_segments; s++)
+    gc_marks.word(s << kSegmentBits);
+  gc_marks.word(kYoungBase);
+}
+
+void gc_mark_parallel(const Stack<size_t>& roots) {
+  gc_finish_sweep();
+  gc_reserve_marks();
+  vector<MarkDeque> deques(gc_threads);
+  for (size_t r = 0; r < roots.size(); r++)
+    deques[r % gc_threads].items.push_back(roots[r]);
+  std::atomic<size_t> idle{0};
+  Heap& heap = vars;
+  MarkBits& marks = gc_marks;
+  Stack<uint32_t>& arena = vector_arena;
+  auto slots = [&](size_t v) { return is_young(v) ? &heap[v].t : arena.data() + heap[v].t; }; // vector_at
+  run_in_threads(gc_threads, [&](size_t id) {
+    vector<size_t> local; // private part of the work, shared only when someone is idle
+    for (;;) {
+      size_t i;
+      bool found = !local.empty();
+      if (found) {
+        i = local.back();
+        local.pop_back();
+        if (idle && local.size() > 1) {
+          for (size_t j = 0; j < local.size() / 2; j++)
+            deques[id].push(local[j]);
+          local.erase(local.begin(), local.begin() + local.size() / 2);
+        }
+      } else
+        found = deques[id].pop(i);
+      for (size_t victim = id + 1; !found && victim < id + gc_threads; victim++)
+        found = deques[victim % gc_threads].steal(i);
+      if (!found) {
+        idle++;
+        for (;;) {
+          if (idle == gc_threads)
+            return;
+          bool has_work = false;
+          for (auto& d : deques)
+            has_work |= !d.empty();
+          if (has_work)
+            break;
+          std::this_thread::yield();
+        }
+        idle--;
+        continue;
+      }
+      while (i && !is_imm(i)) {
+        size_t h = heap[i].h;
+        bool marked = marks.set_shared(i);
+        if (marked || h >= tVal) {
+          for (size_t s = 0, n = !marked && h == tVector ? slots(i)[0] : 0; s < n; s++) {
+            size_t x = slots(i)[1 + s];
+            if (x && !is_imm(x) && !marks.get_shared(x))
+              local.push_back(x);
+          }
+          break;
+        }
+        i = heap[i].t;
+        if (h && !is_imm(h) && !marks.get_shared(h))
+          local.push_back(h);
+      }
+    }
+  });
+}
+
+void gc_sweep_parallel() {
+  gc_reserve_marks();
+  allocated_since_gc = 0;
+  size_t end = max_var + 1;
+  size_t part_size = ((end + 63) / 64 + gc_threads - 1) / gc_threads * 64;
+  struct Part { size_t head = 0, tail = 0, freed = 0, marked = 0; vector<size_t> vectors; };
+  vector<Part> parts(gc_threads);
+  Heap& heap = vars;
+  MarkBits& marks = gc_marks;
+  run_in_threads(gc_threads, [&](size_t id) {
+    Part& p = parts[id];
+    for (size_t base = id * part_size; base < end && base < (id + 1) * part_size; base += 64) {
+      p.marked += __builtin_popcountll(marks.word(base));
+      for (uint64_t dead = gc_dead_slots(base, end, marks); dead; dead &= dead - 1) {
+        size_t i = base + __builtin_ctzll(dead);
+        if (is_collectable(i, heap)) {
+          if (heap[i].h == tVector)
+            p.vectors.push_back(heap[i].t); // free_vectors is not shared
+          heap[i].h = tFree;
+          heap[i].t = p.head;
+          p.head = i;
+          if (!p.tail)
+            p.tail = i;
+          p.freed++;
+        }
+      }
+    }
+  });
+  freed_cnt = marked_cnt = 0;
+  for (auto& p : parts) {
+    if (p.head) {
+      vars[p.tail].t = first_free;
+      first_free = p.head;
+    }
+    for (size_t offset : p.vectors)
+      free_vector(offset);
+    allocated_count -= p.freed;
+    freed_cnt += p.freed;
+    marked_cnt += p.marked;
+  }
+  gc_sweep_done();
+}
+
+void gc_collect(const Stack<size_t>& roots) {
+  if (gc_pause_budget_us) { // snapshot the roots, the rest is done by gc_mark_step
+    gc_finish_sweep();
+    for (size_t r : roots)
+      gc_push(r);
+    gc_marking = true;
+    return;
+  }
+  if (gc_threads > 1) {
+    gc_mark_parallel(roots);
+    gc_sweep_parallel();
+    return;
+  }
+  for (size_t r : roots)
+    gc_mark(r);
+  gc_start_sweep();
+}
+
+// -- compaction
+
+void gc_compact() { // full collection that lays out lists in cdr order, roots are in shadow_stack
+  gc_finish_sweep();
+  assert(young_top == kYoungBase && !gc_marking);
+  vector<uint32_t> fwd(max_var + 1, 0); // new slot of each live cell
+  vector<bool> used(max_var + 1, false);
+  for (size_t i = 1; i <= max_var; i++)
+    if (vars[i].h == tSymbol) // symbols keep their slots: the symbol table and builtins refer to them
+      used[fwd[i] = i] = true;
+  size_t next = 1;
+  vector<size_t> cars;
+  auto place = [&](size_t v) { // puts v and its cdr chain in consecutive slots
+    while (v && !is_imm(v) && !fwd[v]) {
+      while (vars[next].h == tSymbol)
+        next++;
+      used[next] = true;
+      fwd[v] = next++;
+      if (vars[v].h == tVector)
+        for (size_t i = 0; i < vector_size(v); i++)
+          cars.push_back(get_slot(v, i));
+      if (vars[v].h >= tVal)
+        break;
+      cars.push_back(vars[v].h);
+      v = vars[v].t;
+    }
+  };
+  for (size_t r : shadow_stack)
+    place(r);
+  for (size_t i = 0; i < cars.size(); i++) // breadth-first across cars, like Cheney
+    place(cars[i]);
+  auto moved = [&](size_t v) { return !v || is_imm(v) ? v : size_t(fwd[v]); };
+  vector<Var*> to(vars.old_segments);
+  for (auto& s : to)
+    s = new Var[kSegmentSize]();
+  for (size_t i = 1; i <= max_var; i++) {
+    if (!fwd[i]) {
+      if (vars[i].h == tVector)
+        free_vector(vars[i].t);
+      continue;
+    }
+    Var& dst = to[fwd[i] >> kSegmentBits][fwd[i] & (kSegmentSize - 1)];
+    dst = vars[i];
+    if (dst.h < tVal) {
+      dst.h = moved(dst.h);
+      dst.t = moved(dst.t);
+    } else if (dst.h == tVector)
+      for (uint32_t *s = &vector_arena[dst.t + 1], *end = s + vector_arena[dst.t]; s != end; s++)
+        *s = moved(*s);
+  }
+  for (size_t& r : shadow_stack)
+    r = moved(r);
+  for (size_t s = 0; s < to.size(); s++) {
+    delete[] vars.segments[s];
+    vars.segments[s] = to[s];
+  }
+  size_t before = allocated_count;
+  while (max_var && !used[max_var])
+    max_var--;
+  first_free = allocated_count = 0;
+  for (size_t i = max_var; i > 0; i--) {
+    if (used[i])
+      allocated_count++;
+    else {
+      vars[i].h = tFree;
+      vars[i].t = first_free;
+      first_free = i;
+    }
+  }
+  remembered.clear();
+  allocated_since_gc = 0;
+  marked_cnt = allocated_count;
+  freed_cnt = before - allocated_count;
+  gc_adapt();
+}
+
+void gc_collect_at_alloc(std::initializer_list<size_t> extra_roots) { // non-moving, so raw handles stay valid
+  gc_pause pause;
+  for (size_t r : extra_roots)
+    shadow_stack.push_back(r);
+  gc_collect(shadow_stack);
+  shadow_stack.count -= extra_roots.size();
+}
+
+void gc_safepoint() { // called where all live handles are in shadow_stack, so objects can be moved
+  if (gc_marking) {
+    gc_pause pause;
+    gc_mark_step();
+  }
+  if (gc_minor_needed() || gc_needed()) {
+    gc_pause pause;
+    gc_minor();
+    if (gc_needed() && gc_compacting)
+      gc_compact();
+    else if (gc_needed())
+      gc_collect(shadow_stack);
+  }
+}
+
+// -- visualization
+
+thread_local MarkBits format_marks, format_shared;
+
+void format_mark_refs(size_t i) {
+  vector<size_t> stack{i};
+  while (!stack.empty()) {
+    i = stack.back();
+    stack.pop_back();
+    while (i && !is_imm(i)) {
+      size_t h = vars[i].h;
+      if (h == tVector) // closures can't refer to themselves, so vectors need no marks
+        for (size_t s = 0; s < vector_size(i); s++)
+          stack.push_back(get_slot(i, s));
+      if (h >= tVal)
+        break;
+      if (format_marks.set(i)) {
+        format_shared.set(i);
+        break;
+      }
+      if (h && !is_imm(h)) {
+        __builtin_prefetch(&vars[h]);
+        stack.push_back(h);
+      }
+      i = vars[i].t;
+    }
+  }
+}
+
+string name_of(size_t i) {
+  string r;
+  do
+    r += 'a' + i % ('z' - 'a');
+  while ((i /= 'z' - 'a') != 0);
+  return r;
+}
+
+string format_rec(size_t i) {
+  if (!i) return ".";
+  if (is_int(i)) return std::to_string(get_int(i));
+  if (vars[i].h == tSymbol) return symbol_name(i);
+  if (vars[i].h == tLocal) return "$" + std::to_string(vars[i].t);
+  if (vars[i].h == tCaptured) return "^" + std::to_string(vars[i].t);
+  if (vars[i].h == tGlobal) return symbol_name(vars[i].t);
+  if (vars[i].h == tGlobalSlot) return "@" + std::to_string(vars[i].t);
+  if (vars[i].h == tTask) return "<future " + std::to_string(vars[i].t) + ">";
+  if (vars[i].h == tVector) {
+    string r = "[";
+    for (size_t s = 0; s < vector_size(i); s++)
+      r += (s ? " " : "") + format_rec(get_slot(i, s));
+    return r + "]";
+  }
+  if (!format_marks.get(i)) return "#" + name_of(i);
+  string r;
+  if (format_shared.get(i)) r += name_of(i) + ":";
+  r += '(';
+  do {
+    format_marks.reset(i);
+    format_shared.reset(i);
+    r += format_rec(vars[i].h);
+    r += ' ';
+    i = vars[i].t;
+  } while (i && !is_imm(i) && !format_shared.get(i) && format_marks.get(i));
+  return r + format_rec(i) + ')';
+}
+
+string format(size_t i) {
+  format_mark_refs(i);
+  return format_rec(i);
+}
+
+// -- global_ctx
+
+enum {
+  tNil,
+  tLit, tIf, tAdd, tSub, tMul, tLt, tEq, tCon, tHead, tTail,
+  tLambda, tLet, tLetRec, tDefine, // not used in continuation passing
+  tSpawn, tYield, tChan, tSend, tRecv, // green threads, only in cont_eval
+  tFuture, tTouch, tPmap, // run on worker threads, only in cont_eval
+  qAdd, qSub, qMul, qLt, qEq, qCall, // heads of quickened nodes, named so that parse can't make them
+  tUser, // first user defined pair
+};
+
+struct Task;
+thread_local vector<std::shared_ptr<Task>> future_tasks; // of the tTask cells in this heap
+
+thread_local unordered_map<size_t, size_t> global_slots; // symbol to its slot in globals
+thread_local vector<size_t> global_names; // symbol of each slot
+
+
+size_t reset_global_ctx() { // builtins evaluate to their own symbols, defines go to globals, so the global ctx is empty
+  const char* const builtins[] = {"'", "?", "+", "-", "*", "<", "=", ".", "head", "tail", "lambda", "let", "letrec", "define",
+    "spawn", "yield", "chan", "send", "recv", "future", "touch", "pmap",
+    "quick +", "quick -", "quick *", "quick <", "quick =", "quick call"};
+  reset_allocator();
+  future_tasks.clear();
+  global_slots.clear();
+  global_names.clear();
+  for (const auto n: builtins)
+    get_symbol(n);
+  return 0;
+}
+
+size_t global_slot(size_t symbol) { // a new name gets a nil slot
+  auto g = global_slots.find(symbol);
+  if (g != global_slots.end())
+    return g->second;
+  global_names.push_back(symbol);
+  return global_slots[symbol] = global_names.size() - 1;
+}
+
+size_t get_global(size_t slot) {
+  return globals && slot < vector_size(globals) ? get_slot(globals, slot) : 0;
+}
+
+void set_global(size_t slot, size_t value) {
+  if (!globals || slot >= vector_size(globals)) { // doubles, as defines come in a row
+    Root val(value);
+    size_t old_size = globals ? vector_size(globals) : 0;
+    size_t r = mk_vector(std::max(slot + 1, old_size * 2));
+    uint32_t* s = new_slots(r);
+    for (size_t i = 0; i < old_size; i++)
+      s[i] = get_slot(globals, i);
+    globals = r;
+    value = val;
+  }
+  set_slot(globals, slot, value);
+}
+
+size_t mk_ref(size_t tag, size_t slot) { // tLocal, tCaptured, or tGlobal with a symbol
+  if (gc_on_alloc && gc_urgent())
+    gc_collect_at_alloc({});
+  size_t r = alloc_var();
+  vars[r].h = tag;
+  vars[r].t = slot;
+  return r;
+}
+
+void patch_letrec(size_t v, size_t hole) { // the closures made by a letrec initializer captured hole for its value v
+  vector<size_t> todo{v};
+  std::unordered_set<size_t> seen;
+  while (!todo.empty()) {
+    size_t c = todo.back();
+    todo.pop_back();
+    if (!c || is_imm(c) || !seen.insert(c).second)
+      continue;
+    if (is_vector(c)) {
+      for (size_t i = 1; i < vector_size(c); i++) { // slot 0 is the code
+        if (get_slot(c, i) == hole)
+          set_slot(c, i, v);
+        else
+          todo.push_back(get_slot(c, i));
+      }
+    } else if (vars[c].h < tVal) {
+      if (h(c) == hole)
+        set_h(c, v);
+      else
+        todo.push_back(h(c));
+      if (t(c) == hole)
+        set_t(c, v);
+      else
+        todo.push_back(t(c));
+    }
+  }
+}
+
+size_t last_param(size_t frame) { // what calling nil returns
+  return is_vector(frame) && vector_size(frame) > 1 ? get_slot(frame, vector_size(frame) - 1) : 0;
+}
+
+bool cont_eval_only(size_t fn) { return fn >= tSpawn && fn <= tPmap; } // builtins of the green threads and futures
+
+bool quotes_params(size_t fn) { return fn == tLit || (fn >= tLambda && fn <= tDefine); } // so it can't take values
+
+size_t unsupported(size_t fn) { // nil, after telling why
+  if (quotes_params(fn))
+    std::cerr << symbol_name(fn) << " can't be called through a variable in this mode" << std::endl;
+  else
+    std::cerr << symbol_name(fn) << " isn't supported in this mode, only in p mode or e mode without d" << std::endl;
+  return 0;
+}
+
+// -- bytecode
+
+enum {
+  kHalt, kImm, kConst, kLocal, kCaptured, kJump, kJumpIfNot, kClosure, kCall, kTailCall, kRet, kSetLocal,
+  kGlobal, kGlobalSlot, kDefine, kPatchLocal,
+  kAdd, kSub, kMul, kLt, kEq, kCons, kHead, kTail, // same order as tAdd..tTail
+};
+const uint8_t op_sizes[] = {1, 2, 2, 2, 2, 2, 2, 5, 2, 2, 1, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 1, 1, 1};
+const char* const op_names[] = {
+  "halt", "imm", "const", "local", "captured", "jump", "jump_if_not", "closure", "call", "tail_call", "ret", "set_local",
+  "global", "global_slot", "define", "patch_local",
+  "add", "sub", "mul", "lt", "eq", "cons", "head", "tail",
+};
+
+thread_local vector<uint32_t> code; // code[0] is kHalt, the return address of the program
+thread_local vector<size_t> code_consts; // cells the code refers to, on shadow_stack while it runs
+
+size_t apply_builtin(size_t fn, size_t a, size_t b, size_t c) { // builtins called through a variable
+  switch (fn) {
+  case tIf: return a ? b : c; // both evaluated, unlike a direct ?
+  case tAdd: return mk_int(get_int(a) + get_int(b));
+  case tSub: return mk_int(get_int(a) - get_int(b));
+  case tMul: return mk_int(get_int(a) * get_int(b));
+  case tLt: return get_int(a) < get_int(b) ? fn : 0;
+  case tEq: return get_int(a) == get_int(b) ? fn : 0;
+  case tCon: return mk_pair(a, b);
+  case tHead: return h(a);
+  case tTail: return t(a);
+  }
+  return cont_eval_only(fn) || quotes_params(fn) ? unsupported(fn) : 0;
+}
+
+size_t vm_closure(size_t entry) { // for the kClosure before entry, its captured values are popped from the stack
+  Stack<size_t>& s = shadow_stack;
+  size_t count = code[entry - 4], r = mk_vector(count + 1);
+  uint32_t* slots = new_slots(r);
+  slots[0] = mk_int(entry);
+  std::copy(s.end() - count, s.end(), slots + 1);
+  s.resize(s.size() - count);
+  return r;
+}
+
+bool vm_call(size_t count, bool tail, size_t& pc, Root& ctx) { // stack is fn params..., false if a builtin left its result
+  Stack<size_t>& s = shadow_stack;
+  size_t at = s.size() - count - 1;
+  if (!is_vector(s[at])) {
+    s[at] = apply_builtin(s[at], count > 0 ? s[at + 1] : 0, count > 1 ? s[at + 2] : 0, count > 2 ? s[at + 3] : 0);
+    s.resize(at + 1);
+    return false;
+  }
+  size_t entry = get_int(get_slot(s[at], 0)), frame = mk_vector(code[entry - 1]);
+  uint32_t* slots = new_slots(frame);
+  slots[0] = s[at];
+  std::copy_n(s.begin() + at + 1, std::min(count, size_t(code[entry - 2])), slots + 1); // missing ones are nil, as in eval
+  s.resize(at);
+  if (!tail) {
+    s.push_back(ctx);
+    s.push_back(mk_int(pc));
+  }
+  ctx = frame;
+  pc = entry;
+  gc_safepoint();
+  return true;
+}
+
+void vm_ret(size_t& pc, Root& ctx) { // stack is ctx pc result
+  Stack<size_t>& s = shadow_stack;
+  size_t r = s.back();
+  s.pop_back();
+  pc = get_int(s.back());
+  s.pop_back();
+  ctx = s.back();
+  s.back() = r;
+}
+
+// -- threaded continuation passing
+
+enum { // handler followed by its param words; the builtins are in the order of tIf..tTail
+  oCall, // fn, param count, params..., for calls not known to be builtins
+  oIf, oAdd, oSub, oMul, oLt, oEq, oCon, oHead, oTail,
+  oLambda, // marks a lambda: oLambda, param count, frame size, capture count, captures..., body call
+};
+// param word: 0 immediate value, 1 constant on shadow_stack, 2 frame slot, 3 lambda at the index, 4 closure slot,
+// 5 continuation in the frame at the index: the slot of its param, or 0, then its body call
+const uintptr_t kParamBits = 3;
+
+thread_local vector<uintptr_t> tcode;
+thread_local vector<size_t> tcode_ops; // positions of handlers, linked to label addresses by the first run
+thread_local vector<size_t> tcode_consts;
+thread_local bool tcode_linked = false;
+
+size_t cps_code(size_t entry) { return entry + 4 + tcode[entry + 3]; } // the body of the lambda at entry
+
+size_t cps_local(uintptr_t w, size_t ctx) { // value of a param word referring to a slot
+  return get_slot((w & 7) == 2 ? ctx : get_slot(ctx, 0), w >> kParamBits);
+}
+
+size_t cps_closure(size_t entry, size_t ctx) { // vector of the lambda position and the captured values
+  size_t count = tcode[entry + 3], r = mk_vector(count + 1);
+  uint32_t* s = new_slots(r);
+  s[0] = mk_int(entry);
+  for (size_t i = 0; i < count; i++)
+    s[i + 1] = cps_local(tcode[entry + 4 + i], ctx);
+  return r;
+}
+
+void cps_enter(size_t fn, size_t val, Root& ctx, size_t& pc) { // a frame with val in the first param and nil in the rest
+  Root f(fn), v(val);
+  size_t entry = get_int(get_slot(fn, 0)), frame = mk_vector(tcode[entry + 2]);
+  uint32_t* s = new_slots(frame);
+  s[0] = f;
+  if (tcode[entry + 1])
+    s[1] = v;
+  ctx = frame;
+  pc = cps_code(entry);
+  gc_safepoint();
+}
+
+bool cps_apply(size_t fn, size_t a, size_t b, size_t c, Root& ctx, size_t& pc, size_t& result) { // builtin in a variable
+  size_t val = 0, cont = fn < tHead ? c : b;
+  switch (fn) {
+  case tIf: cont = a ? b : c; break;
+  case tAdd: val = mk_int(get_int(a) + get_int(b)); break;
+  case tSub: val = mk_int(get_int(a) - get_int(b)); break;
+  case tMul: val = mk_int(get_int(a) * get_int(b)); break;
+  case tLt: val = get_int(a) < get_int(b) ? tLt : tNil; break;
+  case tEq: val = get_int(a) == get_int(b) ? tEq : tNil; break;
+  case tCon: val = mk_pair(a, b); break;
+  case tHead: val = h(a); break;
+  case tTail: val = t(a); break;
+  }
+  if (!is_vector(cont)) {
+    result = fn == tIf ? cont : val;
+    return false;
+  }
+  cps_enter(cont, val, ctx, pc);
+  return true;
+}